@@ -0,0 +1,362 @@
+/*
+Copyright 2010 Google, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#define _GNU_SOURCE /* asprintf */
+
+#include "exporter.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sysexits.h>
+#include <syslog.h>
+#include <unistd.h>
+
+/* The rendered metrics of one statistics file.  Each file is only reparsed
+ * when inotify reports it was replaced, and the response served to scrapers
+ * is only rebuilt from these fragments when one of them changed.
+ */
+struct stat_entry {
+  struct stat_entry* next;
+
+  char* filename;
+  char* text;
+  size_t len;
+};
+
+static struct stat_entry* entries = NULL;
+static char* response = NULL;
+static size_t response_len = 0;
+static int response_stale = 1;
+
+static const char suffix[] = ".stat";
+
+static const char header[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "# TYPE runstat untyped\n";
+
+static const char not_found[] =
+    "HTTP/1.0 404 Not Found\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static int is_stat_file(const char* filename) {
+  size_t len = strlen(filename);
+
+  return len > sizeof(suffix) - 1 &&
+         strcmp(filename + len - (sizeof(suffix) - 1), suffix) == 0;
+}
+
+static void* xrealloc(void* ptr, size_t size) {
+  if ((ptr = realloc(ptr, size)) == NULL) {
+    perror("realloc");
+    exit(EX_OSERR);
+  }
+  return ptr;
+}
+
+/* Append value to buf as a Prometheus label value. */
+static size_t append_label(char** buf, size_t len, size_t* size,
+                           const char* value) {
+  for (; *value; value++) {
+    if (len + 2 >= *size) {
+      *size *= 2;
+      *buf = xrealloc(*buf, *size);
+    }
+    switch (*value) {
+      case '\\':
+      case '"':
+        (*buf)[len++] = '\\';
+        (*buf)[len++] = *value;
+        break;
+      case '\n':
+        (*buf)[len++] = '\\';
+        (*buf)[len++] = 'n';
+        break;
+      default:
+        (*buf)[len++] = *value;
+        break;
+    }
+  }
+  return len;
+}
+
+static size_t append(char** buf, size_t len, size_t* size, const char* str) {
+  size_t n = strlen(str);
+
+  while (len + n >= *size) {
+    *size *= 2;
+    *buf = xrealloc(*buf, *size);
+  }
+  memcpy(*buf + len, str, n);
+  return len + n;
+}
+
+/* Render the CSV written by runstat as one sample per variable, e.g.
+ *   runstat{job="foo",variable="exit_status",units=""} 0
+ */
+static void render_entry(const char* stat_dirname, struct stat_entry* entry) {
+  char path[PATH_MAX];
+  char line[1024];
+  char job[NAME_MAX + 1];
+  char *name, *value, *units, *end;
+  size_t size = 1024, len = 0;
+  FILE* f;
+
+  entry->len = 0;
+  snprintf(path, sizeof(path), "%s/%s", stat_dirname, entry->filename);
+  if ((f = fopen(path, "r")) == NULL) {
+    syslog(LOG_DEBUG, "%s: %s", path, strerror(errno));
+    return;
+  }
+  snprintf(job, sizeof(job), "%.*s",
+           (int)(strlen(entry->filename) - (sizeof(suffix) - 1)),
+           entry->filename);
+
+  entry->text = xrealloc(entry->text, size);
+  while (fgets(line, sizeof(line), f) != NULL) {
+    /* command,name,value,units */
+    if ((end = strchr(line, '\n')) != NULL) *end = '\0';
+    if ((name = strchr(line, ',')) == NULL) continue;
+    *name++ = '\0';
+    if ((value = strchr(name, ',')) == NULL) continue;
+    *value++ = '\0';
+    if ((units = strchr(value, ',')) == NULL) continue;
+    *units++ = '\0';
+    if (*value == '\0') continue;
+
+    len = append(&entry->text, len, &size, "runstat{job=\"");
+    len = append_label(&entry->text, len, &size, job);
+    len = append(&entry->text, len, &size, "\",variable=\"");
+    len = append_label(&entry->text, len, &size, name);
+    len = append(&entry->text, len, &size, "\",units=\"");
+    len = append_label(&entry->text, len, &size, units);
+    len = append(&entry->text, len, &size, "\"} ");
+    len = append(&entry->text, len, &size, value);
+    len = append(&entry->text, len, &size, "\n");
+  }
+  fclose(f);
+  entry->len = len;
+}
+
+static void update_entry(const char* stat_dirname, const char* filename) {
+  struct stat_entry* entry;
+
+  for (entry = entries; entry != NULL; entry = entry->next) {
+    if (strcmp(entry->filename, filename) == 0) break;
+  }
+  if (entry == NULL) {
+    if ((entry = calloc(1, sizeof(struct stat_entry))) == NULL) {
+      perror("calloc");
+      exit(EX_OSERR);
+    }
+    entry->filename = strdup(filename);
+    entry->next = entries;
+    entries = entry;
+  }
+  syslog(LOG_DEBUG, "updating %s", filename);
+  render_entry(stat_dirname, entry);
+  response_stale = 1;
+}
+
+static void remove_entry(const char* filename) {
+  struct stat_entry **p, *entry;
+
+  for (p = &entries; *p != NULL; p = &(*p)->next) {
+    if (strcmp((*p)->filename, filename) == 0) {
+      entry = *p;
+      *p = entry->next;
+      free(entry->filename);
+      free(entry->text);
+      free(entry);
+      response_stale = 1;
+      return;
+    }
+  }
+}
+
+static void scan_directory(const char* stat_dirname) {
+  DIR* dir;
+  struct dirent* de;
+
+  if ((dir = opendir(stat_dirname)) == NULL) {
+    perror(stat_dirname);
+    exit(EX_NOINPUT);
+  }
+  while ((de = readdir(dir)) != NULL) {
+    if (is_stat_file(de->d_name)) update_entry(stat_dirname, de->d_name);
+  }
+  closedir(dir);
+}
+
+static void rebuild_response(void) {
+  struct stat_entry* entry;
+  size_t len;
+
+  len = sizeof(header) - 1;
+  for (entry = entries; entry != NULL; entry = entry->next) len += entry->len;
+  response = xrealloc(response, len);
+
+  memcpy(response, header, sizeof(header) - 1);
+  response_len = sizeof(header) - 1;
+  for (entry = entries; entry != NULL; entry = entry->next) {
+    memcpy(response + response_len, entry->text, entry->len);
+    response_len += entry->len;
+  }
+  response_stale = 0;
+}
+
+static void read_events(int inotify_fd, const char* stat_dirname) {
+  union {
+    struct inotify_event event;
+    char buf[4096];
+  } u;
+  const struct inotify_event* event;
+  ssize_t len;
+  size_t offset;
+
+  while ((len = read(inotify_fd, u.buf, sizeof(u.buf))) > 0) {
+    for (offset = 0; offset < (size_t)len;
+         offset += sizeof(struct inotify_event) + event->len) {
+      event = (const struct inotify_event*)(const void*)(u.buf + offset);
+      if (event->mask & IN_Q_OVERFLOW) {
+        syslog(LOG_WARNING, "inotify queue overflowed, rescanning");
+        scan_directory(stat_dirname);
+        continue;
+      }
+      if (event->len == 0 || !is_stat_file(event->name)) continue;
+      if (event->mask & (IN_MOVED_TO | IN_CLOSE_WRITE)) {
+        update_entry(stat_dirname, event->name);
+      } else if (event->mask & (IN_MOVED_FROM | IN_DELETE)) {
+        remove_entry(event->name);
+      }
+    }
+  }
+  if (len < 0 && errno != EAGAIN && errno != EINTR) {
+    perror("read inotify");
+    exit(EX_OSERR);
+  }
+}
+
+static void write_all(int fd, const char* buf, size_t len) {
+  ssize_t n;
+
+  while (len > 0) {
+    if ((n = write(fd, buf, len)) < 0) {
+      if (errno == EINTR) continue;
+      syslog(LOG_DEBUG, "write: %s", strerror(errno));
+      return;
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+static void serve_client(int listen_fd) {
+  int fd;
+  char request[1024];
+  ssize_t n;
+  struct timeval tv;
+
+  if ((fd = accept(listen_fd, NULL, NULL)) < 0) {
+    if (errno != EINTR && errno != EAGAIN) perror("accept");
+    return;
+  }
+  /* Don't let a stuck scraper wedge the exporter. */
+  tv.tv_sec = 1;
+  tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  if ((n = read(fd, request, sizeof(request) - 1)) < 0) n = 0;
+  request[n] = '\0';
+  if (n > 0 && strncmp(request, "GET /metrics", 12) != 0 &&
+      strncmp(request, "GET / ", 6) != 0) {
+    write_all(fd, not_found, sizeof(not_found) - 1);
+  } else {
+    if (response_stale) rebuild_response();
+    write_all(fd, response, response_len);
+  }
+  close(fd);
+}
+
+/* Serve the statistics of every job in stat_dirname on the Unix socket
+ * sockname, as a Prometheus text exposition over HTTP.  Only returns on
+ * error.
+ */
+int run_exporter(const char* stat_dirname, const char* sockname) {
+  int inotify_fd, listen_fd;
+  struct sockaddr_un sock;
+  struct pollfd fds[2];
+
+  signal(SIGPIPE, SIG_IGN);
+
+  if ((inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+    perror("inotify_init1");
+    return EX_OSERR;
+  }
+  if (inotify_add_watch(inotify_fd, stat_dirname,
+                        IN_MOVED_TO | IN_CLOSE_WRITE | IN_MOVED_FROM |
+                            IN_DELETE) < 0) {
+    perror(stat_dirname);
+    return EX_NOINPUT;
+  }
+  /* Scan after adding the watch so no file written in between is missed. */
+  scan_directory(stat_dirname);
+
+  if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    perror("socket");
+    return EX_OSERR;
+  }
+  memset(&sock, 0, sizeof(sock));
+  sock.sun_family = AF_UNIX;
+  strncpy(sock.sun_path, sockname, sizeof(sock.sun_path) - 1);
+  unlink(sock.sun_path);
+  if (bind(listen_fd, (struct sockaddr*)&sock, sizeof(sock)) < 0 ||
+      listen(listen_fd, 16) < 0) {
+    perror(sockname);
+    return EX_CANTCREAT;
+  }
+  syslog(LOG_INFO, "exporting %s on %s", stat_dirname, sockname);
+
+  fds[0].fd = inotify_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = listen_fd;
+  fds[1].events = POLLIN;
+  for (;;) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      return EX_OSERR;
+    }
+    /* Apply pending updates first so a scrape never sees a stale file. */
+    if (fds[0].revents & POLLIN) read_events(inotify_fd, stat_dirname);
+    if (fds[1].revents & POLLIN) serve_client(listen_fd);
+  }
+}
@@ -0,0 +1,22 @@
+/*
+Copyright 2010 Google, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef __CRONUTILS_EXPORTER_H
+#define __CRONUTILS_EXPORTER_H
+
+int run_exporter(const char* stat_dirname, const char* sockname);
+
+#endif /* __CRONUTILS_EXPORTER_H */
@@ -0,0 +1,253 @@
+/*
+Copyright 2010 Google, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#define _GNU_SOURCE /* asprintf, setenv */
+
+#include "jobboard.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sysexits.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tempdir.h"
+
+/* "job1"; change it if struct job_board changes */
+#define JOB_BOARD_MAGIC 0x6a6f6231
+/* give up on a slot that is being written by someone who died doing so */
+#define MAX_SPINS 1000000
+
+const char* job_phase_names[NR_JOB_PHASES] = {
+    "starting", "admission", "waiting-for-lock",
+    "running",  "backoff",   "writing-stats"};
+
+static struct job_board* board = NULL;
+static struct job_slot* claimed_slot = NULL;
+
+/* Map the job board, creating it if writable.  The board is advisory, so
+ * failures are only logged, and NULL returned.
+ */
+struct job_board* open_job_board(const char* filename, int writable) {
+  struct job_board* b;
+  struct stat st;
+  void* p;
+  int fd;
+
+  if ((fd = open(filename, writable ? O_RDWR | O_CREAT : O_RDONLY,
+                 S_IRUSR | S_IWUSR)) < 0) {
+    syslog(LOG_DEBUG, "%s: %s", filename, strerror(errno));
+    return NULL;
+  }
+  if (fstat(fd, &st) < 0) {
+    syslog(LOG_WARNING, "fstat %s: %s", filename, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  /* growing a new board to its size twice over is harmless, and the new
+   * pages read as zeros, that is, as free slots */
+  if (st.st_size < (off_t)sizeof(struct job_board) &&
+      (!writable || ftruncate(fd, sizeof(struct job_board)) < 0)) {
+    syslog(LOG_WARNING, "%s is too small to be a job board", filename);
+    close(fd);
+    return NULL;
+  }
+  p = mmap(NULL, sizeof(struct job_board),
+           writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    syslog(LOG_WARNING, "mmap %s: %s", filename, strerror(errno));
+    return NULL;
+  }
+  b = p;
+  if (writable) __sync_bool_compare_and_swap(&b->magic, 0, JOB_BOARD_MAGIC);
+  if (b->magic != JOB_BOARD_MAGIC) {
+    syslog(LOG_WARNING, "%s is not a job board", filename);
+    munmap(p, sizeof(struct job_board));
+    return NULL;
+  }
+  return b;
+}
+
+/* Make the sequence count odd.  The compare and swap keeps writers apart,
+ * and is a full barrier, so none of the writes that follow are seen
+ * before it.  This may run in a signal handler, so it must not log.
+ */
+static void write_begin(struct job_slot* slot) {
+  unsigned int seq;
+  long spins;
+
+  for (spins = 0; spins < MAX_SPINS; spins++) {
+    seq = slot->seq;
+    if (!(seq & 1) && __sync_bool_compare_and_swap(&slot->seq, seq, seq + 1))
+      return;
+  }
+  /* a writer died mid-update; the count stays odd until write_end() */
+}
+
+static void write_end(struct job_slot* slot) {
+  __sync_fetch_and_add(&slot->seq, 1);
+}
+
+/* Free the slot this process claimed, if any.  Called at exit, and from
+ * the termination handler, so it makes no system call but getpid().
+ */
+void job_release(void) {
+  struct job_slot* slot = claimed_slot;
+
+  /* a forked child that fails to exec mustn't free its parent's slot */
+  if (slot == NULL || slot->owner != getpid()) return;
+  write_begin(slot);
+  slot->phase = JOB_STARTING;
+  slot->command[0] = '\0';
+  slot->owner = 0;
+  write_end(slot);
+  claimed_slot = NULL;
+}
+
+static struct job_slot* join_slot(void) {
+  const char* env;
+  int index, parent;
+
+  if ((env = getenv(JOB_SLOT_ENV)) == NULL ||
+      sscanf(env, "%d:%d", &index, &parent) != 2 || parent != getppid() ||
+      index < 0 || index >= JOB_BOARD_SLOTS ||
+      board->slots[index].owner == 0)
+    return NULL;
+  return &board->slots[index];
+}
+
+/* Take a free slot, or one left by a dead tool.  The slot is returned
+ * inside a write section, so no reader sees our pid alongside the fields
+ * of the slot's previous job; the caller fills them in and ends it.
+ */
+static struct job_slot* claim_slot(void) {
+  struct job_slot* slot;
+  int owner;
+  int i;
+
+  for (i = 0; i < JOB_BOARD_SLOTS; i++) {
+    slot = &board->slots[i];
+    owner = slot->owner;
+    /* a tool that was killed outright leaves its slot behind */
+    if (owner != 0 && (kill(owner, 0) == 0 || errno != ESRCH)) continue;
+    write_begin(slot);
+    if (__sync_bool_compare_and_swap(&slot->owner, owner, getpid())) {
+      return slot;
+    }
+    write_end(slot);
+  }
+  return NULL;
+}
+
+/* Put this job on the board, or if we were started by a tool that already
+ * has, update its slot.  The command shown is that of the innermost tool.
+ * Returns NULL if there is no board or no free slot; the other job_*
+ * functions accept that.
+ */
+struct job_slot* job_register(const char* tool, char** args) {
+  struct job_slot* slot;
+  char* filename;
+  char buf[32];
+  size_t len = 0, n;
+  int claimed = 0;
+
+  if (board == NULL) {
+    if (asprintf(&filename, "%s/%s", make_tempdir(), JOB_BOARD_FILENAME) ==
+        -1) {
+      perror("asprintf");
+      exit(EX_OSERR);
+    }
+    board = open_job_board(filename, 1);
+    free(filename);
+    if (board == NULL) return NULL;
+  }
+  if ((slot = join_slot()) != NULL) {
+    write_begin(slot);
+  } else if ((slot = claim_slot()) != NULL) {
+    claimed = 1;
+  } else {
+    syslog(LOG_INFO, "job board is full, not registering");
+    return NULL;
+  }
+
+  if (claimed) {
+    slot->start_time = time(NULL);
+    slot->deadline = 0;
+    strncpy(slot->tool, tool, JOB_TOOL_LEN - 1);
+    slot->tool[JOB_TOOL_LEN - 1] = '\0';
+  }
+  slot->phase = JOB_STARTING;
+  slot->command[0] = '\0';
+  for (; *args != NULL && len < JOB_COMMAND_LEN - 1; args++) {
+    n = snprintf(slot->command + len, JOB_COMMAND_LEN - len, "%s%s",
+                 len > 0 ? " " : "", *args);
+    len += n;
+  }
+  write_end(slot);
+
+  if (claimed) {
+    claimed_slot = slot;
+    atexit(job_release);
+  }
+  snprintf(buf, sizeof(buf), "%d:%d", (int)(slot - board->slots),
+           (int)getpid());
+  if (setenv(JOB_SLOT_ENV, buf, 1) < 0) perror("setenv");
+  return slot;
+}
+
+void job_set_phase(struct job_slot* slot, enum job_phase phase) {
+  if (slot == NULL) return;
+  write_begin(slot);
+  slot->phase = phase;
+  write_end(slot);
+}
+
+void job_set_deadline(struct job_slot* slot, long deadline) {
+  if (slot == NULL) return;
+  write_begin(slot);
+  /* an enclosing runalarm's deadline may be sooner */
+  if (slot->deadline == 0 || deadline < slot->deadline) {
+    slot->deadline = deadline;
+  }
+  write_end(slot);
+}
+
+/* Copy a slot without stopping its writers.  Returns 1 if the slot holds
+ * a job, 0 if it is free, and -1 if it kept changing under us.
+ */
+int job_read(const struct job_slot* slot, struct job_slot* copy) {
+  unsigned int seq;
+  long spins;
+
+  for (spins = 0; spins < MAX_SPINS; spins++) {
+    seq = slot->seq;
+    if (seq & 1) continue;
+    __sync_synchronize();
+    memcpy(copy, slot, sizeof(*copy));
+    __sync_synchronize();
+    if (slot->seq == seq) return copy->owner != 0;
+  }
+  return -1;
+}
@@ -0,0 +1,76 @@
+/*
+Copyright 2010 Google, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef __CRONUTILS_JOBBOARD_H
+#define __CRONUTILS_JOBBOARD_H
+
+/* A table of the jobs running under any of the tools, in a file that is
+ * mapped shared by all of them.  Each job's slot is claimed by the
+ * outermost tool, which writes its pid into owner and frees it again at
+ * exit; the tools it wraps join the same slot and update its phase.
+ * Writers bracket their updates with a sequence count, and readers retry
+ * until they see the same even count before and after copying a slot, so
+ * neither side takes a lock.
+ */
+
+#define JOB_BOARD_FILENAME "jobs"
+#define JOB_BOARD_SLOTS 256
+#define JOB_COMMAND_LEN 120
+#define JOB_TOOL_LEN 16
+
+/* Environment variable naming the slot and the pid of the tool that last
+ * joined it, as "slot:pid", so only that tool's own child joins it.
+ */
+#define JOB_SLOT_ENV "CRONUTILS_JOB_SLOT"
+
+enum job_phase {
+  JOB_STARTING,
+  JOB_ADMISSION,
+  JOB_WAITING_FOR_LOCK,
+  JOB_RUNNING,
+  JOB_BACKOFF,
+  JOB_WRITING_STATS,
+  NR_JOB_PHASES
+};
+
+struct job_slot {
+  /* odd while a writer is updating the slot */
+  volatile unsigned int seq;
+  /* pid of the tool that claimed the slot, or 0 if it is free */
+  volatile int owner;
+  int phase;
+  /* seconds since the epoch; deadline is 0 if there is none */
+  long start_time;
+  long deadline;
+  char tool[JOB_TOOL_LEN];
+  char command[JOB_COMMAND_LEN];
+};
+
+struct job_board {
+  volatile unsigned int magic;
+  struct job_slot slots[JOB_BOARD_SLOTS];
+};
+
+extern const char* job_phase_names[NR_JOB_PHASES];
+
+struct job_board* open_job_board(const char* filename, int writable);
+struct job_slot* job_register(const char* tool, char** args);
+void job_set_phase(struct job_slot* slot, enum job_phase phase);
+void job_set_deadline(struct job_slot* slot, long deadline);
+void job_release(void);
+int job_read(const struct job_slot* slot, struct job_slot* copy);
+
+#endif /* __CRONUTILS_JOBBOARD_H */
@@ -0,0 +1,255 @@
+/*
+Copyright 2010 Google, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "pressure.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char* resource_names[NR_PRESSURE] = {"cpu", "memory", "io"};
+
+/* PSI trigger window; unprivileged triggers must use a multiple of 2s */
+#define TRIGGER_WINDOW_US 2000000
+/* backoff between checks of the averages, in milliseconds */
+#define MIN_BACKOFF_MS 1000
+#define MAX_BACKOFF_MS 30000
+
+void init_pressure_limits(struct pressure_limits* limits) {
+  int i;
+
+  for (i = 0; i < NR_PRESSURE; i++) {
+    limits->avg10[i] = -1;
+    limits->avg60[i] = -1;
+  }
+  limits->cgroup = NULL;
+  limits->max_wait = 300;
+}
+
+/* spec is resource=avg10[,avg60], e.g. "memory=10" or "io=20,40" */
+int parse_pressure_limit(struct pressure_limits* limits, const char* spec) {
+  int i;
+  size_t len;
+  const char* value;
+  char* endptr;
+  double avg10, avg60 = -1;
+
+  if ((value = strchr(spec, '=')) == NULL) return -1;
+  len = value - spec;
+  for (i = 0; i < NR_PRESSURE; i++) {
+    if (strlen(resource_names[i]) == len &&
+        strncmp(spec, resource_names[i], len) == 0)
+      break;
+  }
+  if (i == NR_PRESSURE) return -1;
+
+  avg10 = strtod(value + 1, &endptr);
+  if (endptr == value + 1) return -1;
+  if (*endptr == ',') {
+    value = endptr + 1;
+    avg60 = strtod(value, &endptr);
+    /* written so that NaN fails too */
+    if (endptr == value || !(avg60 >= 0 && avg60 <= 100)) return -1;
+  }
+  if (*endptr || !(avg10 >= 0 && avg10 <= 100)) return -1;
+
+  limits->avg10[i] = avg10;
+  limits->avg60[i] = avg60;
+  return 0;
+}
+
+int pressure_limited(const struct pressure_limits* limits) {
+  int i;
+
+  for (i = 0; i < NR_PRESSURE; i++) {
+    if (limits->avg10[i] >= 0 || limits->avg60[i] >= 0) return 1;
+  }
+  return 0;
+}
+
+static void pressure_path(const struct pressure_limits* limits, int resource,
+                          char* buf, size_t len) {
+  if (limits->cgroup != NULL) {
+    snprintf(buf, len, "%s/%s.pressure", limits->cgroup,
+             resource_names[resource]);
+  } else {
+    snprintf(buf, len, "/proc/pressure/%s", resource_names[resource]);
+  }
+}
+
+/* Returns 1 if the resource is under its limits, 0 if not, and -1 if the
+ * pressure file could not be read, in which case the limit is ignored.
+ */
+static int below_limits(const struct pressure_limits* limits, int resource) {
+  char path[PATH_MAX];
+  FILE* f;
+  double avg10, avg60;
+  int n;
+
+  pressure_path(limits, resource, path, sizeof(path));
+  if ((f = fopen(path, "r")) == NULL) {
+    syslog(LOG_WARNING, "%s: %s, ignoring %s pressure limit", path,
+           strerror(errno), resource_names[resource]);
+    return -1;
+  }
+  n = fscanf(f, "some avg10=%lf avg60=%lf", &avg10, &avg60);
+  fclose(f);
+  if (n != 2) {
+    syslog(LOG_WARNING, "%s: unparseable, ignoring %s pressure limit", path,
+           resource_names[resource]);
+    return -1;
+  }
+  syslog(LOG_DEBUG, "%s pressure avg10=%.2f avg60=%.2f",
+         resource_names[resource], avg10, avg60);
+  if (limits->avg10[resource] >= 0 && avg10 > limits->avg10[resource])
+    return 0;
+  if (limits->avg60[resource] >= 0 && avg60 > limits->avg60[resource])
+    return 0;
+  return 1;
+}
+
+static int all_below_limits(const struct pressure_limits* limits) {
+  int i;
+
+  for (i = 0; i < NR_PRESSURE; i++) {
+    if (limits->avg10[i] < 0 && limits->avg60[i] < 0) continue;
+    if (below_limits(limits, i) == 0) return 0;
+  }
+  return 1;
+}
+
+/* Arm a PSI trigger that fires whenever the stall time within a window
+ * exceeds the avg10 threshold.  Returns the pollable fd, or -1 if the
+ * kernel doesn't support triggers on this file.
+ */
+static int open_trigger(const struct pressure_limits* limits, int resource) {
+  char path[PATH_MAX];
+  char trigger[64];
+  long stall_us;
+  int fd;
+
+  if (limits->avg10[resource] <= 0) return -1;
+  stall_us = (long)(limits->avg10[resource] * TRIGGER_WINDOW_US / 100);
+  pressure_path(limits, resource, path, sizeof(path));
+  if ((fd = open(path, O_RDWR | O_NONBLOCK)) < 0) return -1;
+  snprintf(trigger, sizeof(trigger), "some %ld %d", stall_us,
+           TRIGGER_WINDOW_US);
+  if (write(fd, trigger, strlen(trigger) + 1) < 0) {
+    syslog(LOG_DEBUG, "%s: cannot set trigger: %s", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static double seconds_since(const struct timespec* start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Sleep for interval_ms, watching the armed triggers.  Returns 1 if any
+ * trigger fired, meaning the stall time is still above the threshold.
+ */
+static int backoff(struct pollfd* fds, int nfds, int interval_ms) {
+  struct timespec start, ts;
+  int remaining;
+  int i, fired = 0;
+
+  if (nfds == 0) {
+    ts.tv_sec = interval_ms / 1000;
+    ts.tv_nsec = (interval_ms % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+      ;
+    return 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  remaining = interval_ms;
+  while (remaining > 0) {
+    if (poll(fds, nfds, remaining) < 0) {
+      if (errno != EINTR) {
+        perror("poll");
+        return 0;
+      }
+    }
+    for (i = 0; i < nfds; i++) {
+      if (fds[i].revents & POLLPRI) fired = 1;
+    }
+    remaining = interval_ms - (int)(seconds_since(&start) * 1000);
+  }
+  return fired;
+}
+
+/* Block until all configured pressure limits are satisfied, or max_wait
+ * seconds have passed.  Returns 0 if the job may start, or -1 if the limits
+ * were still exceeded when max_wait ran out.  The time spent waiting is
+ * stored in waited.
+ */
+int wait_for_pressure(const struct pressure_limits* limits, double* waited) {
+  struct timespec start;
+  struct pollfd fds[NR_PRESSURE];
+  int nfds = 0;
+  int i, fd;
+  int result = 0;
+  int interval_ms = MIN_BACKOFF_MS;
+  double remaining;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  *waited = 0;
+  if (all_below_limits(limits)) return 0;
+
+  for (i = 0; i < NR_PRESSURE; i++) {
+    if ((fd = open_trigger(limits, i)) >= 0) {
+      fds[nfds].fd = fd;
+      fds[nfds].events = POLLPRI;
+      nfds++;
+    }
+  }
+  syslog(LOG_INFO, "pressure above limits, waiting up to %d seconds",
+         limits->max_wait);
+
+  for (;;) {
+    remaining = limits->max_wait - seconds_since(&start);
+    if (remaining <= 0) {
+      result = -1;
+      break;
+    }
+    if (interval_ms > remaining * 1000) interval_ms = remaining * 1000 + 1;
+    /* While a trigger keeps firing the stall is ongoing, so back off further
+     * without rereading the averages.  Once a whole interval passes quietly
+     * the averages are decaying, so check them and poll again soon.
+     */
+    if (backoff(fds, nfds, interval_ms)) {
+      interval_ms *= 2;
+    } else {
+      if (all_below_limits(limits)) break;
+      interval_ms = nfds > 0 ? MIN_BACKOFF_MS : interval_ms * 2;
+    }
+    if (interval_ms > MAX_BACKOFF_MS) interval_ms = MAX_BACKOFF_MS;
+  }
+
+  for (i = 0; i < nfds; i++) close(fds[i].fd);
+  *waited = seconds_since(&start);
+  return result;
+}
@@ -0,0 +1,42 @@
+/*
+Copyright 2010 Google, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef __CRONUTILS_PRESSURE_H
+#define __CRONUTILS_PRESSURE_H
+
+enum pressure_resource {
+  PRESSURE_CPU,
+  PRESSURE_MEMORY,
+  PRESSURE_IO,
+  NR_PRESSURE
+};
+
+struct pressure_limits {
+  /* thresholds on the "some" stall percentage; negative means no limit */
+  double avg10[NR_PRESSURE];
+  double avg60[NR_PRESSURE];
+  /* cgroup directory holding *.pressure files, or NULL for /proc/pressure */
+  const char* cgroup;
+  /* seconds to wait for pressure to drop before giving up */
+  int max_wait;
+};
+
+void init_pressure_limits(struct pressure_limits* limits);
+int parse_pressure_limit(struct pressure_limits* limits, const char* spec);
+int pressure_limited(const struct pressure_limits* limits);
+int wait_for_pressure(const struct pressure_limits* limits, double* waited);
+
+#endif /* __CRONUTILS_PRESSURE_H */
@@ -0,0 +1,108 @@
+/*
+Copyright 2010 Google, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "procstat.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+
+static FILE* open_proc(pid_t pid, const char* name) {
+  char path[64];
+  FILE* f;
+
+  snprintf(path, sizeof(path), "/proc/%d/%s", (int)pid, name);
+  if ((f = fopen(path, "r")) == NULL) {
+    syslog(LOG_DEBUG, "%s: %s", path, strerror(errno));
+  }
+  return f;
+}
+
+static void read_io(pid_t pid, struct proc_snapshot* snap) {
+  char key[64];
+  double value;
+  FILE* f;
+  int n = 0;
+
+  if ((f = open_proc(pid, "io")) == NULL) return;
+  while (fscanf(f, "%63[^:]: %lf ", key, &value) == 2) {
+    n++;
+    if (strcmp(key, "rchar") == 0) {
+      snap->rchar = value;
+    } else if (strcmp(key, "wchar") == 0) {
+      snap->wchar = value;
+    } else if (strcmp(key, "read_bytes") == 0) {
+      snap->read_bytes = value;
+    } else if (strcmp(key, "write_bytes") == 0) {
+      snap->write_bytes = value;
+    } else if (strcmp(key, "cancelled_write_bytes") == 0) {
+      snap->cancelled_write_bytes = value;
+    }
+  }
+  fclose(f);
+  snap->have_io = n > 0;
+}
+
+static void read_schedstat(pid_t pid, struct proc_snapshot* snap) {
+  FILE* f;
+
+  if ((f = open_proc(pid, "schedstat")) == NULL) return;
+  snap->have_schedstat = fscanf(f, "%lf %lf %lf", &snap->run_time,
+                                &snap->run_delay, &snap->timeslices) == 3;
+  fclose(f);
+}
+
+/* Only the context switches are still in a zombie's status; VmHWM and the
+ * other memory fields go with its address space.
+ */
+static void read_status(pid_t pid, struct proc_snapshot* snap) {
+  char key[64];
+  double value;
+  FILE* f;
+  int n = 0;
+
+  if ((f = open_proc(pid, "status")) == NULL) return;
+  while (fscanf(f, "%63[^:]:", key) == 1) {
+    if (strcmp(key, "voluntary_ctxt_switches") == 0 &&
+        fscanf(f, "%lf", &value) == 1) {
+      snap->voluntary_ctxt_switches = value;
+      n++;
+    } else if (strcmp(key, "nonvoluntary_ctxt_switches") == 0 &&
+               fscanf(f, "%lf", &value) == 1) {
+      snap->nonvoluntary_ctxt_switches = value;
+      n++;
+    }
+    /* skip the rest of the line */
+    if (fscanf(f, "%*[^\n]") == EOF || fgetc(f) == EOF) break;
+  }
+  fclose(f);
+  snap->have_ctxt = n == 2;
+}
+
+/* A pre-reap hook for a struct subprocess whose data is a proc_snapshot.
+ * The memory maps are already gone by the time a process is a zombie, so
+ * its status and smaps_rollup no longer have peak memory; that still
+ * comes from the rusage collected when it is reaped.
+ */
+void snapshot_subprocess(struct subprocess* sp) {
+  struct proc_snapshot* snap = sp->data;
+
+  memset(snap, 0, sizeof(*snap));
+  read_io(sp->pid, snap);
+  read_schedstat(sp->pid, snap);
+  read_status(sp->pid, snap);
+}
@@ -0,0 +1,47 @@
+/*
+Copyright 2010 Google, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef __CRONUTILS_PROCSTAT_H
+#define __CRONUTILS_PROCSTAT_H
+
+#include "subprocess.h"
+
+/* What /proc still knows about an exited child before it is reaped.  IO
+ * counts include the descendants it reaped; scheduler times, in
+ * nanoseconds, and context switches are for its main thread.  Each part
+ * is set only if it was readable.
+ */
+struct proc_snapshot {
+  int have_io;
+  double rchar;
+  double wchar;
+  double read_bytes;
+  double write_bytes;
+  double cancelled_write_bytes;
+
+  int have_schedstat;
+  double run_time;
+  double run_delay;
+  double timeslices;
+
+  int have_ctxt;
+  double voluntary_ctxt_switches;
+  double nonvoluntary_ctxt_switches;
+};
+
+void snapshot_subprocess(struct subprocess* sp);
+
+#endif /* __CRONUTILS_PROCSTAT_H */
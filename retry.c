@@ -0,0 +1,142 @@
+/*
+Copyright 2010 Google, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#define _GNU_SOURCE /* setenv, random */
+
+#include "retry.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+static const struct {
+  const char* name;
+  int number;
+} signal_names[] = {
+    {"HUP", SIGHUP},   {"INT", SIGINT},   {"QUIT", SIGQUIT},
+    {"ABRT", SIGABRT}, {"KILL", SIGKILL}, {"SEGV", SIGSEGV},
+    {"PIPE", SIGPIPE}, {"ALRM", SIGALRM}, {"TERM", SIGTERM},
+    {"BUS", SIGBUS},   {"USR1", SIGUSR1}, {"USR2", SIGUSR2},
+    {NULL, 0}};
+
+void init_retry_policy(struct retry_policy* policy) {
+  memset(policy, 0, sizeof(*policy));
+  policy->any_failure = 1;
+  policy->base_delay = 1;
+  policy->max_delay = 60;
+}
+
+/* spec is a comma separated list of exit statuses and signal names, e.g.
+ * "75,111,SIGKILL"; a command killed by signal n exits with 128 + n.
+ */
+int parse_retry_statuses(struct retry_policy* policy, const char* spec) {
+  const char* p = spec;
+  const char* end;
+  char* endptr;
+  size_t len;
+  long n;
+  int i;
+
+  for (;;) {
+    if (strncmp(p, "SIG", 3) == 0) {
+      len = strcspn(p + 3, ",");
+      for (i = 0; signal_names[i].name != NULL; i++) {
+        if (strlen(signal_names[i].name) == len &&
+            strncmp(p + 3, signal_names[i].name, len) == 0)
+          break;
+      }
+      if (signal_names[i].name == NULL) return -1;
+      n = 128 + signal_names[i].number;
+      end = p + 3 + len;
+    } else {
+      n = strtol(p, &endptr, 10);
+      /* zero is success, which is never retried */
+      if (endptr == p || n <= 0 || n >= NR_STATUSES) return -1;
+      end = endptr;
+    }
+    policy->retry_on[n] = 1;
+    if (*end == '\0') break;
+    if (*end != ',') return -1;
+    p = end + 1;
+  }
+  policy->any_failure = 0;
+  return 0;
+}
+
+/* A status of -1 means the command was killed by us, and is not retried. */
+int retry_wanted(const struct retry_policy* policy, int status) {
+  if (status <= 0 || status >= NR_STATUSES) return 0;
+  return policy->any_failure || policy->retry_on[status];
+}
+
+long inherited_deadline(void) {
+  const char* value;
+  char* endptr;
+  long deadline;
+
+  if ((value = getenv(DEADLINE_ENV)) == NULL) return 0;
+  deadline = strtol(value, &endptr, 10);
+  if (endptr == value || *endptr || deadline < 0) return 0;
+  return deadline;
+}
+
+/* Pass our deadline on to the command, unless an outer runalarm's is
+ * sooner.
+ */
+void export_deadline(long timeout) {
+  char buf[32];
+  long deadline, outer;
+
+  deadline = (long)time(NULL) + timeout;
+  if ((outer = inherited_deadline()) > 0 && outer < deadline) return;
+  snprintf(buf, sizeof(buf), "%ld", deadline);
+  if (setenv(DEADLINE_ENV, buf, 1) < 0) perror("setenv");
+}
+
+/* Sleep before the given retry, counting from 1.  The delay is drawn
+ * uniformly from zero up to the exponentially growing cap ("full jitter"),
+ * so that jobs which failed together don't come back together.  Returns
+ * -1 without sleeping if that would run past the deadline of an enclosing
+ * runalarm, as the attempt would only be killed.
+ */
+int retry_backoff(const struct retry_policy* policy, int retry,
+                  double* waited) {
+  struct timespec ts;
+  double cap = policy->base_delay, delay;
+  long deadline;
+  int i;
+
+  for (i = 1; i < retry && cap < policy->max_delay; i++) cap *= 2;
+  if (cap > policy->max_delay) cap = policy->max_delay;
+  delay = cap * (random() / (RAND_MAX + 1.0));
+
+  deadline = inherited_deadline();
+  if (deadline > 0 && time(NULL) + delay >= deadline) {
+    syslog(LOG_INFO, "no time left for retry %d before the deadline", retry);
+    return -1;
+  }
+  syslog(LOG_DEBUG, "retry %d in %.3f seconds", retry, delay);
+  ts.tv_sec = (time_t)delay;
+  ts.tv_nsec = (long)((delay - ts.tv_sec) * 1e9);
+  while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+    ;
+  *waited += delay;
+  return 0;
+}
@@ -0,0 +1,49 @@
+/*
+Copyright 2010 Google, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef __CRONUTILS_RETRY_H
+#define __CRONUTILS_RETRY_H
+
+/* exit statuses run from 0 to 255, and signals are reported as 128 + n */
+#define NR_STATUSES 256
+
+/* Environment variable in which runalarm passes its deadline, in seconds
+ * since the epoch, to the commands it runs.
+ */
+#define DEADLINE_ENV "RUNALARM_DEADLINE"
+
+struct retry_policy {
+  /* attempts after the first; zero disables retrying */
+  int retries;
+  /* statuses worth another attempt; if none are set, any failure is */
+  char retry_on[NR_STATUSES];
+  int any_failure;
+  /* retries count from 1, and the backoff before retry n is uniform in
+   * [0, min(max, base * 2^(n - 1)))
+   */
+  double base_delay;
+  double max_delay;
+};
+
+void init_retry_policy(struct retry_policy* policy);
+int parse_retry_statuses(struct retry_policy* policy, const char* spec);
+int retry_wanted(const struct retry_policy* policy, int status);
+int retry_backoff(const struct retry_policy* policy, int retry,
+                  double* waited);
+long inherited_deadline(void);
+void export_deadline(long timeout);
+
+#endif /* __CRONUTILS_RETRY_H */
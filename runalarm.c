@@ -24,9 +24,13 @@ limitations under the License.
 #include <string.h>
 #include <sysexits.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "jobboard.h"
+#include "retry.h"
 #include "subprocess.h"
+#include "watchdog.h"
 
 int timeout = 60 * 60 * 24; /* 1 day */
 volatile sig_atomic_t alarm_triggered = 0;
@@ -42,6 +46,14 @@ static void usage(char* prog) {
           " -d   send log messages to stderr as well as syslog.\n"
           " -h   print this help\n",
           prog);
+  fprintf(stderr,
+          "\nstall watchdog options:\n"
+          " -s stall  kill the process if it makes no progress for this\n"
+          "           many seconds, where progress is any of:\n"
+          " -o   output on stdout or stderr\n"
+          " -b file   a change to the modification time of file\n"
+          " -c   CPU time used by the process or its descendants\n"
+          "           (the default, if none of these are given)\n");
 }
 
 static void alarm_handler(int signum) {
@@ -65,10 +77,13 @@ int main(int argc, char** argv) {
   char* endptr;
   struct sigaction sa, old_sa;
   int debug = 0;
+  struct watchdog wd;
+  struct job_slot* job;
 
+  memset(&wd, 0, sizeof(wd));
   progname = argv[0];
 
-  while ((arg = getopt(argc, argv, "+t:hd")) > 0) {
+  while ((arg = getopt(argc, argv, "+t:hds:ob:c")) > 0) {
     switch (arg) {
       case 'h':
         usage(progname);
@@ -84,6 +99,22 @@ int main(int argc, char** argv) {
       case 'd':
         debug = LOG_PERROR;
         break;
+      case 's':
+        wd.stall_timeout = strtol(optarg, &endptr, 10);
+        if (*endptr || !optarg || wd.stall_timeout <= 0) {
+          fprintf(stderr, "invalid stall timeout specified: %s\n", optarg);
+          exit(EX_DATAERR);
+        }
+        break;
+      case 'o':
+        wd.watch_output = 1;
+        break;
+      case 'b':
+        wd.heartbeat = optarg;
+        break;
+      case 'c':
+        wd.watch_cpu = 1;
+        break;
       default:
         break;
     }
@@ -107,13 +138,33 @@ int main(int argc, char** argv) {
   sa.sa_handler = alarm_handler;
   sa.sa_flags = 0;
   sigaction(SIGALRM, &sa, &old_sa);
+  job = job_register("runalarm", command_args);
+  set_termination_function(job_release);
+  job_set_phase(job, JOB_RUNNING);
+  /* a timeout of zero never fires, so there is no deadline */
+  if (timeout > 0) {
+    job_set_deadline(job, (long)time(NULL) + timeout);
+    /* let a retrying runstat know how long it has */
+    export_deadline(timeout);
+  }
   /* exec the command */
-  status = run_subprocess(command, command_args, &set_timeout_alarm);
+  if (wd.stall_timeout > 0) {
+    if (!wd.watch_output && wd.heartbeat == NULL) wd.watch_cpu = 1;
+    status = run_watched(command, command_args, &wd, &set_timeout_alarm);
+  } else {
+    status = run_subprocess(command, command_args, &set_timeout_alarm);
+  }
   alarm(0); /* shutdown the alarm */
   if (alarm_triggered) {
     syslog(LOG_INFO, "command '%s' timed out after %d seconds",
            basename(command), timeout);
     status = 128 + SIGALRM;
+  } else if (wd.stalled) {
+    syslog(LOG_INFO, "command '%s' stalled, no progress%s%s%s for %d seconds",
+           basename(command), wd.watch_output ? " [output]" : "",
+           wd.heartbeat ? " [heartbeat]" : "", wd.watch_cpu ? " [cpu]" : "",
+           wd.stall_timeout);
+    status = 128 + SIGVTALRM;
   }
   closelog();
   exit(status);
@@ -27,14 +27,30 @@ limitations under the License.
 #include <sys/stat.h>
 #include <sysexits.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "jobboard.h"
 #include "subprocess.h"
 #include "tempdir.h"
 
-char* lock_filename = NULL;
+struct lock {
+  char* filename;
+  int shared;
+  int fd;
+  int held;
+  dev_t dev;
+  ino_t ino;
+};
+
+struct lock* locks = NULL;
+int nlocks = 0;
 volatile sig_atomic_t timeout_expired = 0;
 
+/* backoff after giving up a partially acquired set, in milliseconds */
+#define MIN_BACKOFF_MS 10
+#define MAX_BACKOFF_MS 1000
+
 static void usage(char* prog) {
   fprintf(stderr,
           "Usage: %s [options] command [arg [arg] ...]\n\n"
@@ -47,8 +63,10 @@ static void usage(char* prog) {
   fprintf(stderr,
           "\noptions:\n"
           " -d       send log messages to stderr as well as syslog.\n"
-          " -f lock_filename path to use as a lock file\n"
-          " -t timeout  time in seconds to wait to acquire the lock\n"
+          " -f lock_filename path to use as an exclusive lock file\n"
+          " -s lock_filename path to use as a shared lock file\n"
+          "          -f and -s may be repeated to hold several locks\n"
+          " -t timeout  time in seconds to wait to acquire the locks\n"
           " -h       this help.\n");
 }
 
@@ -58,27 +76,176 @@ static void alarm_handler(int signum) {
   timeout_expired = 1;
 }
 
+static void add_lock(const char* filename, int shared) {
+  locks = realloc(locks, (nlocks + 1) * sizeof(struct lock));
+  if (locks == NULL) {
+    perror("realloc");
+    exit(EX_OSERR);
+  }
+  memset(&locks[nlocks], 0, sizeof(struct lock));
+  if (asprintf(&locks[nlocks].filename, "%s", filename) == -1) {
+    perror("asprintf");
+    exit(EX_OSERR);
+  }
+  locks[nlocks].shared = shared;
+  locks[nlocks].fd = -1;
+  nlocks++;
+}
+
+/* Every runlock takes its locks in the same order, by file identity. */
+static int compare_locks(const void* a, const void* b) {
+  const struct lock* la = a;
+  const struct lock* lb = b;
+
+  if (la->dev != lb->dev) return la->dev < lb->dev ? -1 : 1;
+  if (la->ino != lb->ino) return la->ino < lb->ino ? -1 : 1;
+  /* for the same file listed twice, sort the exclusive lock first */
+  return la->shared - lb->shared;
+}
+
+static void open_locks(void) {
+  struct stat st;
+  int i, j;
+
+  for (i = 0; i < nlocks; i++) {
+    if ((locks[i].fd = open(locks[i].filename, O_CREAT | O_RDWR,
+                            S_IRUSR | S_IWUSR)) < 0) {
+      perror(locks[i].filename);
+      exit(EX_NOINPUT);
+    }
+    if (fstat(locks[i].fd, &st) < 0) {
+      perror("fstat");
+      exit(EX_OSERR);
+    }
+    locks[i].dev = st.st_dev;
+    locks[i].ino = st.st_ino;
+  }
+  qsort(locks, nlocks, sizeof(struct lock), compare_locks);
+  /* fcntl locks are per process and file, so keep one lock per file */
+  for (i = 1, j = 0; i < nlocks; i++) {
+    if (locks[i].dev == locks[j].dev && locks[i].ino == locks[j].ino) {
+      close(locks[i].fd);
+    } else {
+      locks[++j] = locks[i];
+    }
+  }
+  if (nlocks > 0) nlocks = j + 1;
+}
+
+static int set_lock(struct lock* lock, int type, int cmd) {
+  struct flock fl;
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  return fcntl(lock->fd, cmd, &fl);
+}
+
+static int lock_type(const struct lock* lock) {
+  return lock->shared ? F_RDLCK : F_WRLCK;
+}
+
+static void release_locks(void) {
+  int i;
+
+  for (i = 0; i < nlocks; i++) {
+    if (locks[i].held) {
+      set_lock(&locks[i], F_UNLCK, F_SETLK);
+      locks[i].held = 0;
+    }
+  }
+}
+
+/* Exits unless errno shows the lock attempt was merely interrupted. */
+static void lock_failed(const struct lock* lock, int timeout) {
+  switch (errno) {
+    case EINTR:
+      if (timeout_expired) {
+        syslog(LOG_INFO,
+               "waited %d seconds, %s already locked by another process",
+               timeout, lock->filename);
+        exit(EX_CANTCREAT);
+      }
+      break;
+    case EACCES:
+    case EAGAIN:
+      syslog(LOG_INFO, "%s already locked by another process",
+             lock->filename);
+      exit(EX_CANTCREAT);
+      break;
+    default:
+      perror("fcntl");
+      exit(EXIT_FAILURE);
+  }
+}
+
+/* Acquire all the locks, or none.  They are tried without blocking in
+ * their canonical order.  On finding one taken, the others are let go
+ * before blocking on it, so a runlock never waits while holding a lock
+ * and can't deadlock with another; once it has the contended lock, the
+ * rest are tried again.  The SIGALRM timer bounds the whole attempt.
+ */
+static void acquire_locks(int timeout) {
+  struct timespec ts;
+  int backoff_ms = MIN_BACKOFF_MS;
+  long delay_ms;
+  int i, held;
+
+  for (;;) {
+    held = 0;
+    for (i = 0; i < nlocks; i++) {
+      if (locks[i].held) {
+        held++;
+        continue;
+      }
+      if (set_lock(&locks[i], lock_type(&locks[i]), F_SETLK) < 0) {
+        if (errno != EACCES && errno != EAGAIN) {
+          lock_failed(&locks[i], timeout);
+        }
+        break;
+      }
+      locks[i].held = 1;
+      held++;
+    }
+    if (i == nlocks) return;
+
+    syslog(LOG_DEBUG, "%s is locked, waiting", locks[i].filename);
+    if (held > 0) {
+      release_locks();
+      /* jitter, so that runlocks contending for the same set don't retry
+       * in lockstep */
+      delay_ms = random() % backoff_ms + 1;
+      ts.tv_sec = delay_ms / 1000;
+      ts.tv_nsec = (delay_ms % 1000) * 1000000L;
+      if (nanosleep(&ts, NULL) < 0) lock_failed(&locks[i], timeout);
+      backoff_ms *= 2;
+      if (backoff_ms > MAX_BACKOFF_MS) backoff_ms = MAX_BACKOFF_MS;
+    }
+    while (set_lock(&locks[i], lock_type(&locks[i]), F_SETLKW) < 0) {
+      lock_failed(&locks[i], timeout);
+    }
+    locks[i].held = 1;
+  }
+}
+
 int main(int argc, char** argv) {
   char* progname;
   int arg;
   char* command;
   char** command_args;
   int status = 0;
-  struct flock fl;
-  int fd;
+  char* lock_filename;
   char buf[BUFSIZ];
   struct sigaction sa, old_sa;
   int debug = 0;
   int timeout = 5;
   char* endptr;
-
-  memset(&fl, 0, sizeof(fl));
-  fl.l_type = F_WRLCK;
-  fl.l_whence = SEEK_SET;
+  int i;
+  struct job_slot* job;
 
   progname = argv[0];
 
-  while ((arg = getopt(argc, argv, "+df:ht:")) > 0) {
+  while ((arg = getopt(argc, argv, "+df:s:ht:")) > 0) {
     switch (arg) {
       case 'h':
         usage(progname);
@@ -88,10 +255,10 @@ int main(int argc, char** argv) {
         debug = LOG_PERROR;
         break;
       case 'f':
-        if (asprintf(&lock_filename, "%s", optarg) == -1) {
-          perror("asprintf");
-          exit(EX_OSERR);
-        }
+        add_lock(optarg, 0);
+        break;
+      case 's':
+        add_lock(optarg, 1);
         break;
       case 't':
         timeout = strtol(optarg, &endptr, 10);
@@ -118,57 +285,47 @@ int main(int argc, char** argv) {
   else
     setlogmask(LOG_UPTO(LOG_INFO));
 
-  if (lock_filename == NULL) {
+  if (nlocks == 0) {
     if (asprintf(&lock_filename, "%s/%s.pid", make_tempdir(),
                  basename(command)) == -1) {
       perror("asprintf");
       exit(EX_OSERR);
     }
+    add_lock(lock_filename, 0);
+  }
+  for (i = 0; i < nlocks; i++) {
+    syslog(LOG_DEBUG, "%s lock filename is %s",
+           locks[i].shared ? "shared" : "exclusive", locks[i].filename);
   }
-  syslog(LOG_DEBUG, "lock filename is %s", lock_filename);
+  srandom(getpid() ^ time(NULL));
+  job = job_register("runlock", command_args);
+  set_termination_function(job_release);
+  job_set_phase(job, JOB_WAITING_FOR_LOCK);
 
   sa.sa_handler = alarm_handler;
   sigemptyset(&sa.sa_mask);
   sa.sa_flags = 0;
   sigaction(SIGALRM, &sa, &old_sa);
   alarm(timeout);
-  if ((fd = open(lock_filename, O_CREAT | O_RDWR | O_TRUNC,
-                 S_IRUSR | S_IWUSR)) < 0) {
-    perror(lock_filename);
-    exit(EX_NOINPUT);
-  } else {
-    if (fcntl(fd, F_SETLKW, &fl) < 0) {
-      switch (errno) {
-        case EINTR:
-          if (timeout_expired) {
-            syslog(LOG_INFO,
-                   "waited %d seconds, already locked by another process",
-                   timeout);
-            exit(EX_CANTCREAT);
-          }
-          break;
-        case EACCES:
-        case EAGAIN:
-          syslog(LOG_INFO, "already locked by another process");
-          exit(EX_CANTCREAT);
-          break;
-        default:
-          perror("fcntl");
-          exit(EXIT_FAILURE);
-      }
-    } else {
-      alarm(0);
-      sigaction(SIGALRM, &old_sa, NULL);
-      snprintf(buf, BUFSIZ, "%d\n", getpid());
-      if (write(fd, buf, strlen(buf)) == -1) {
-        perror("write");
-      }
-      fsync(fd);
-      syslog(LOG_DEBUG, "lock granted");
-      status = run_subprocess(command, command_args, NULL);
-      close(fd);
+  open_locks();
+  acquire_locks(timeout);
+  alarm(0);
+  sigaction(SIGALRM, &old_sa, NULL);
+
+  /* only the holder of an exclusive lock may rewrite the file */
+  snprintf(buf, BUFSIZ, "%d\n", getpid());
+  for (i = 0; i < nlocks; i++) {
+    if (locks[i].shared) continue;
+    if (ftruncate(locks[i].fd, 0) == -1 ||
+        write(locks[i].fd, buf, strlen(buf)) == -1) {
+      perror("write");
     }
+    fsync(locks[i].fd);
   }
+  syslog(LOG_DEBUG, "lock granted");
+  job_set_phase(job, JOB_RUNNING);
+  status = run_subprocess(command, command_args, NULL);
+  for (i = 0; i < nlocks; i++) close(locks[i].fd);
   closelog();
   return status;
 }
@@ -32,7 +32,13 @@ limitations under the License.
 #include <time.h>
 #include <unistd.h>
 
+#include "exporter.h"
+#include "jobboard.h"
+#include "pressure.h"
+#include "procstat.h"
+#include "retry.h"
 #include "subprocess.h"
+#include "taskstats.h"
 #include "tempdir.h"
 
 static void usage(char* prog) {
@@ -42,13 +48,36 @@ static void usage(char* prog) {
           "subprocess, and upon termination of the subprocess"
           "writes some runtime statistics to a file."
           "These statistics include time of execution, exit"
-          "status, and timestamp of completion.\n"
+          "status, and timestamp of completion.\n",
+          prog);
+  fprintf(stderr,
           "\noptions:\n"
           " -f path  Path to save the statistics file.\n"
           " -C path  Path to collectd socket.\n"
+          " -x path  Instead of running a command, serve the statistics\n"
+          "          of all jobs on this Unix socket; -f names the\n"
+          "          directory of statistics files to watch.\n"
+          " -T       Also record the delay accounting and IO of the\n"
+          "          command and its descendants from taskstats.\n"
           " -d       send log messages to stderr as well as syslog.\n"
-          " -h       print this help\n",
-          prog);
+          " -h       print this help\n");
+  fprintf(stderr,
+          "\nadmission control options:\n"
+          " -p resource=avg10[,avg60]\n"
+          "          Wait until the cpu, memory or io pressure is below\n"
+          "          these percentages before running the command.\n"
+          " -g path  cgroup directory to read pressure from.\n"
+          " -w secs  Longest time to wait for pressure to drop.\n"
+          " -a       Give up, rather than run anyway, if the pressure\n"
+          "          is still too high after waiting.\n");
+  fprintf(stderr,
+          "\nretry options:\n"
+          " -r count Retry a failed command up to this many times.\n"
+          " -R status[,status...]\n"
+          "          Only retry on these exit statuses or signal names,\n"
+          "          e.g. 75,SIGKILL; by default any failure is retried.\n"
+          " -b secs  Cap on the first backoff, doubled for each retry.\n"
+          " -B secs  Largest cap on the backoff.\n");
 }
 
 enum var_kind { GAUGE, ABSOLUTE };
@@ -88,10 +117,56 @@ void add_variable(struct variable** var_list, const char* name,
   *var_list = var;
 }
 
+/* Add up what /proc had for each attempt. */
+static void sum_snapshot(struct proc_snapshot* sum,
+                         const struct proc_snapshot* snap) {
+  sum->have_io |= snap->have_io;
+  sum->rchar += snap->rchar;
+  sum->wchar += snap->wchar;
+  sum->read_bytes += snap->read_bytes;
+  sum->write_bytes += snap->write_bytes;
+  sum->cancelled_write_bytes += snap->cancelled_write_bytes;
+  sum->have_schedstat |= snap->have_schedstat;
+  sum->run_time += snap->run_time;
+  sum->run_delay += snap->run_delay;
+  sum->timeslices += snap->timeslices;
+  sum->have_ctxt |= snap->have_ctxt;
+  sum->voluntary_ctxt_switches += snap->voluntary_ctxt_switches;
+  sum->nonvoluntary_ctxt_switches += snap->nonvoluntary_ctxt_switches;
+}
+
+static void sum_totals(struct taskstats_totals* sum,
+                       const struct taskstats_totals* totals) {
+  if (totals->tasks < 0) return;
+  if (sum->tasks < 0) {
+    *sum = *totals;
+    return;
+  }
+  sum->tasks += totals->tasks;
+  sum->cpu_delay += totals->cpu_delay;
+  sum->blkio_delay += totals->blkio_delay;
+  sum->swapin_delay += totals->swapin_delay;
+  sum->freepages_delay += totals->freepages_delay;
+  sum->read_bytes += totals->read_bytes;
+  sum->write_bytes += totals->write_bytes;
+  if (totals->hiwater_rss > sum->hiwater_rss)
+    sum->hiwater_rss = totals->hiwater_rss;
+  if (totals->hiwater_vm > sum->hiwater_vm)
+    sum->hiwater_vm = totals->hiwater_vm;
+}
+
+static double seconds_since(const struct timespec* start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
 int main(int argc, char** argv) {
   char* progname;
   int arg;
   char* collectd_sockname = NULL;
+  char* exporter_sockname = NULL;
   char* statistics_filename = NULL;
   char* temp_filename = NULL;
   char* command;
@@ -104,12 +179,29 @@ int main(int argc, char** argv) {
   int temp_fd;
   char buf[1024];
   int debug = 0;
+  char* endptr;
   struct rusage ru;
   struct variable *var_list = NULL, *var;
-
+  struct pressure_limits limits;
+  int give_up = 0;
+  int admitted = 1;
+  double admission_wait = 0;
+  int use_taskstats = 0;
+  struct taskstats_totals totals, attempt_totals;
+  struct subprocess child;
+  struct proc_snapshot snapshot, attempt_snapshot;
+  struct retry_policy policy;
+  struct timespec attempt_start;
+  double* attempt_elapsed;
+  double retry_wait = 0;
+  int attempt, attempts = 0;
+  struct job_slot* job;
+
+  init_pressure_limits(&limits);
+  init_retry_policy(&policy);
   progname = argv[0];
 
-  while ((arg = getopt(argc, argv, "+C:f:hd")) > 0) {
+  while ((arg = getopt(argc, argv, "+C:f:hdp:g:w:ax:Tr:R:b:B:")) > 0) {
     switch (arg) {
       case 'C':
         if (asprintf(&collectd_sockname, "%s", optarg) == -1) {
@@ -130,10 +222,71 @@ int main(int argc, char** argv) {
       case 'd':
         debug = LOG_PERROR;
         break;
+      case 'p':
+        if (parse_pressure_limit(&limits, optarg) < 0) {
+          fprintf(stderr, "invalid pressure limit specified: %s\n", optarg);
+          exit(EX_DATAERR);
+        }
+        break;
+      case 'g':
+        limits.cgroup = optarg;
+        break;
+      case 'w':
+        limits.max_wait = strtol(optarg, &endptr, 10);
+        if (*endptr || !optarg || limits.max_wait < 0) {
+          fprintf(stderr, "invalid wait time specified: %s\n", optarg);
+          exit(EX_DATAERR);
+        }
+        break;
+      case 'a':
+        give_up = 1;
+        break;
+      case 'x':
+        exporter_sockname = optarg;
+        break;
+      case 'T':
+        use_taskstats = 1;
+        break;
+      case 'r':
+        policy.retries = strtol(optarg, &endptr, 10);
+        if (*endptr || !optarg || policy.retries < 0) {
+          fprintf(stderr, "invalid retry count specified: %s\n", optarg);
+          exit(EX_DATAERR);
+        }
+        break;
+      case 'R':
+        if (parse_retry_statuses(&policy, optarg) < 0) {
+          fprintf(stderr, "invalid retry statuses specified: %s\n", optarg);
+          exit(EX_DATAERR);
+        }
+        break;
+      case 'b':
+        policy.base_delay = strtod(optarg, &endptr);
+        if (*endptr || endptr == optarg || policy.base_delay < 0) {
+          fprintf(stderr, "invalid backoff specified: %s\n", optarg);
+          exit(EX_DATAERR);
+        }
+        break;
+      case 'B':
+        policy.max_delay = strtod(optarg, &endptr);
+        if (*endptr || endptr == optarg || policy.max_delay < 0) {
+          fprintf(stderr, "invalid backoff specified: %s\n", optarg);
+          exit(EX_DATAERR);
+        }
+        break;
       default:
         break;
     }
   }
+  if (exporter_sockname != NULL) {
+    openlog(progname, debug | LOG_ODELAY | LOG_PID | LOG_NOWAIT, LOG_CRON);
+    setlogmask(LOG_UPTO(debug ? LOG_DEBUG : LOG_INFO));
+    status = run_exporter(statistics_filename ? statistics_filename
+                                              : make_tempdir(),
+                          exporter_sockname);
+    closelog();
+    return status;
+  }
   if (optind >= argc) {
     usage(progname);
     exit(EXIT_FAILURE);
@@ -148,10 +301,70 @@ int main(int argc, char** argv) {
   else
     setlogmask(LOG_UPTO(LOG_INFO));
 
+  job = job_register("runstat", command_args);
+  set_termination_function(job_release);
+  if (pressure_limited(&limits)) {
+    job_set_phase(job, JOB_ADMISSION);
+    if (wait_for_pressure(&limits, &admission_wait) < 0) {
+      if (give_up) {
+        syslog(LOG_INFO, "pressure still too high after %d seconds, giving up",
+               limits.max_wait);
+        admitted = 0;
+      } else {
+        syslog(LOG_INFO,
+               "pressure still too high after %d seconds, running anyway",
+               limits.max_wait);
+      }
+    }
+  }
+
   gettimeofday(&start_wall_time, NULL);
   clock_gettime(CLOCK_MONOTONIC, &start_run_time);
 
-  status = run_subprocess(command, command_args, NULL);
+  attempt_elapsed = calloc(policy.retries + 1, sizeof(double));
+  if (attempt_elapsed == NULL) {
+    perror("calloc");
+    exit(EX_OSERR);
+  }
+  srandom(getpid() ^ time(NULL));
+  memset(&snapshot, 0, sizeof(snapshot));
+  totals.tasks = -1;
+  status = EX_TEMPFAIL;
+  job_set_phase(job, JOB_RUNNING);
+  /* Any retries happen here, inside the budget of an enclosing runalarm
+   * and while an enclosing runlock still holds its locks.
+   */
+  for (attempt = 0; admitted && attempt <= policy.retries; attempt++) {
+    clock_gettime(CLOCK_MONOTONIC, &attempt_start);
+    /* snapshot the child's /proc entry between its exit and reaping */
+    subprocess_init(&child);
+    /* the hook isn't called if the child couldn't be waited for */
+    memset(&attempt_snapshot, 0, sizeof(attempt_snapshot));
+    child.pre_reap_function = snapshot_subprocess;
+    child.data = &attempt_snapshot;
+    attempt_totals.tasks = -1;
+    if (use_taskstats) {
+      status = run_subprocess_taskstats(&child, command, command_args,
+                                        &attempt_totals);
+    } else {
+      if (subprocess_start(&child, command, command_args) < 0) {
+        perror("fork");
+        exit(EX_OSERR);
+      }
+      status = subprocess_wait(&child);
+    }
+    attempt_elapsed[attempts++] = seconds_since(&attempt_start);
+    sum_snapshot(&snapshot, &attempt_snapshot);
+    sum_totals(&totals, &attempt_totals);
+
+    if (attempt == policy.retries || !retry_wanted(&policy, status)) break;
+    syslog(LOG_INFO, "command '%s' failed with status %d, retry %d of %d",
+           basename(command), status, attempt + 1, policy.retries);
+    job_set_phase(job, JOB_BACKOFF);
+    if (retry_backoff(&policy, attempt + 1, &retry_wait) < 0) break;
+    job_set_phase(job, JOB_RUNNING);
+  }
+  job_set_phase(job, JOB_WRITING_STATS);
 
   clock_gettime(CLOCK_MONOTONIC, &end_run_time);
   gettimeofday(&end_wall_time, NULL);
@@ -179,6 +392,19 @@ int main(int argc, char** argv) {
 
   /** process */
   add_variable(&var_list, "exit_status", GAUGE, NULL, "%d", status);
+  if (pressure_limited(&limits)) {
+    add_variable(&var_list, "admission_wait", GAUGE, "s", "%.3f",
+                 admission_wait);
+  }
+  if (policy.retries > 0) {
+    add_variable(&var_list, "attempts", GAUGE, "attempts", "%d", attempts);
+    add_variable(&var_list, "retry_wait", GAUGE, "s", "%.3f", retry_wait);
+    for (attempt = 0; attempt < attempts; attempt++) {
+      snprintf(buf, sizeof(buf), "attempt_elapsed-%d", attempt + 1);
+      add_variable(&var_list, buf, GAUGE, "s", "%.9f",
+                   attempt_elapsed[attempt]);
+    }
+  }
 
   /** wall time */
   /* ABSOLUTE hostname/runstat-progname/last_run-epoch_timestamp_start */
@@ -236,6 +462,57 @@ int main(int argc, char** argv) {
                  "%ld", ru.ru_nivcsw);
   }
 
+  /** IO and scheduling of the child, from /proc just before reaping */
+  if (snapshot.have_io) {
+    add_variable(&var_list, "io_chars-read", GAUGE, "B", "%.0f",
+                 snapshot.rchar);
+    add_variable(&var_list, "io_chars-write", GAUGE, "B", "%.0f",
+                 snapshot.wchar);
+    add_variable(&var_list, "io_storage-read", GAUGE, "B", "%.0f",
+                 snapshot.read_bytes);
+    add_variable(&var_list, "io_storage-write", GAUGE, "B", "%.0f",
+                 snapshot.write_bytes);
+    add_variable(&var_list, "io_storage-cancelled_write", GAUGE, "B", "%.0f",
+                 snapshot.cancelled_write_bytes);
+  }
+  if (snapshot.have_schedstat) {
+    add_variable(&var_list, "sched-run_time", GAUGE, "s", "%.9f",
+                 snapshot.run_time / 1e9);
+    add_variable(&var_list, "sched-run_delay", GAUGE, "s", "%.9f",
+                 snapshot.run_delay / 1e9);
+    add_variable(&var_list, "sched-timeslices", GAUGE, "timeslices", "%.0f",
+                 snapshot.timeslices);
+  }
+  if (snapshot.have_ctxt) {
+    add_variable(&var_list, "sched-ctx_switch_voluntary", GAUGE,
+                 "context switches", "%.0f",
+                 snapshot.voluntary_ctxt_switches);
+    add_variable(&var_list, "sched-ctx_switch_involuntary", GAUGE,
+                 "context switches", "%.0f",
+                 snapshot.nonvoluntary_ctxt_switches);
+  }
+
+  /** delay accounting, from taskstats */
+  if (totals.tasks >= 0) {
+    add_variable(&var_list, "tasks", GAUGE, "tasks", "%ld", totals.tasks);
+    add_variable(&var_list, "delay-cpu", GAUGE, "s", "%.9f",
+                 totals.cpu_delay / 1e9);
+    add_variable(&var_list, "delay-blkio", GAUGE, "s", "%.9f",
+                 totals.blkio_delay / 1e9);
+    add_variable(&var_list, "delay-swapin", GAUGE, "s", "%.9f",
+                 totals.swapin_delay / 1e9);
+    add_variable(&var_list, "delay-freepages", GAUGE, "s", "%.9f",
+                 totals.freepages_delay / 1e9);
+    add_variable(&var_list, "io_bytes-read", GAUGE, "B", "%.0f",
+                 totals.read_bytes);
+    add_variable(&var_list, "io_bytes-write", GAUGE, "B", "%.0f",
+                 totals.write_bytes);
+    add_variable(&var_list, "hiwater-rss", GAUGE, "B", "%.0f",
+                 totals.hiwater_rss);
+    add_variable(&var_list, "hiwater-vm", GAUGE, "B", "%.0f",
+                 totals.hiwater_vm);
+  }
+
   /* CSV emitter */
   for (var = var_list; var != NULL; var = var->next) {
     snprintf(buf, sizeof(buf), "%s,%s,%s,%s\n", basename(command), var->name,
@@ -0,0 +1,173 @@
+/*
+Copyright 2010 Google, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#define _GNU_SOURCE /* asprintf */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "jobboard.h"
+#include "tempdir.h"
+
+static void usage(char* prog) {
+  fprintf(stderr,
+          "Usage: %s [options]\n\n"
+          "This program shows the jobs running under runalarm, runlock\n"
+          "and runstat, what they are doing, and for how long.\n"
+          "\noptions:\n"
+          " -f path  job board to read (default /tmp/cronutils-$USER/%s)\n"
+          " -i secs  seconds between updates (default 2)\n"
+          " -n count exit after this many updates\n"
+          " -d       send log messages to stderr as well as syslog.\n"
+          " -h       print this help\n",
+          prog, JOB_BOARD_FILENAME);
+}
+
+static int compare_jobs(const void* a, const void* b) {
+  const struct job_slot* ja = a;
+  const struct job_slot* jb = b;
+
+  if (ja->start_time != jb->start_time)
+    return ja->start_time < jb->start_time ? -1 : 1;
+  return ja->owner - jb->owner;
+}
+
+static void format_duration(char* buf, size_t len, long secs) {
+  if (secs >= 86400) {
+    snprintf(buf, len, "%ldd%02ldh", secs / 86400, secs % 86400 / 3600);
+  } else {
+    snprintf(buf, len, "%ld:%02ld:%02ld", secs / 3600, secs % 3600 / 60,
+             secs % 60);
+  }
+}
+
+/* One screenful.  Only the mapped board is read; nothing in here makes a
+ * system call per job.
+ */
+static void show_jobs(const struct job_board* board, struct job_slot* jobs) {
+  char elapsed[32], remaining[32], stamp[32];
+  time_t now;
+  int i, n = 0, phase;
+
+  for (i = 0; board != NULL && i < JOB_BOARD_SLOTS; i++) {
+    if (job_read(&board->slots[i], &jobs[n]) > 0) n++;
+  }
+  qsort(jobs, n, sizeof(struct job_slot), compare_jobs);
+
+  now = time(NULL);
+  strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&now));
+  printf("%d jobs at %s\n", n, stamp);
+  printf("%-7s %-9s %-16s %9s %9s %s\n", "PID", "TOOL", "PHASE", "ELAPSED",
+         "REMAINING", "COMMAND");
+  for (i = 0; i < n; i++) {
+    format_duration(elapsed, sizeof(elapsed), now - jobs[i].start_time);
+    if (jobs[i].deadline == 0) {
+      strcpy(remaining, "-");
+    } else if (jobs[i].deadline < now) {
+      strcpy(remaining, "overdue");
+    } else {
+      format_duration(remaining, sizeof(remaining), jobs[i].deadline - now);
+    }
+    phase = jobs[i].phase;
+    printf("%-7d %-9s %-16s %9s %9s %s\n", jobs[i].owner, jobs[i].tool,
+           phase >= 0 && phase < NR_JOB_PHASES ? job_phase_names[phase] : "?",
+           elapsed, remaining, jobs[i].command);
+  }
+}
+
+int main(int argc, char** argv) {
+  char* progname;
+  int arg;
+  char* board_filename = NULL;
+  struct job_board* board;
+  struct job_slot* jobs;
+  int interval = 2;
+  int count = -1;
+  int debug = 0;
+  int clear;
+  char* endptr;
+
+  progname = argv[0];
+
+  while ((arg = getopt(argc, argv, "f:i:n:dh")) > 0) {
+    switch (arg) {
+      case 'f':
+        board_filename = optarg;
+        break;
+      case 'i':
+        interval = strtol(optarg, &endptr, 10);
+        if (*endptr || !optarg || interval <= 0) {
+          fprintf(stderr, "invalid interval specified: %s\n", optarg);
+          exit(EX_DATAERR);
+        }
+        break;
+      case 'n':
+        count = strtol(optarg, &endptr, 10);
+        if (*endptr || !optarg || count <= 0) {
+          fprintf(stderr, "invalid count specified: %s\n", optarg);
+          exit(EX_DATAERR);
+        }
+        break;
+      case 'd':
+        debug = LOG_PERROR;
+        break;
+      case 'h':
+        usage(progname);
+        exit(EXIT_SUCCESS);
+        break;
+      default:
+        usage(progname);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  openlog(progname, debug | LOG_ODELAY | LOG_PID | LOG_NOWAIT, LOG_CRON);
+  if (debug)
+    setlogmask(LOG_UPTO(LOG_DEBUG));
+  else
+    setlogmask(LOG_UPTO(LOG_INFO));
+
+  if (board_filename == NULL &&
+      asprintf(&board_filename, "%s/%s", make_tempdir(), JOB_BOARD_FILENAME) ==
+          -1) {
+    perror("asprintf");
+    exit(EX_OSERR);
+  }
+  /* no board yet means no job has registered; show an empty table */
+  board = open_job_board(board_filename, 0);
+  if ((jobs = calloc(JOB_BOARD_SLOTS, sizeof(struct job_slot))) == NULL) {
+    perror("calloc");
+    exit(EX_OSERR);
+  }
+
+  clear = isatty(STDOUT_FILENO) && count != 1;
+  for (;;) {
+    if (clear) printf("\033[H\033[J");
+    show_jobs(board, jobs);
+    fflush(stdout);
+    if (count > 0 && --count == 0) break;
+    sleep(interval);
+    /* the first job may have created the board since */
+    if (board == NULL) board = open_job_board(board_filename, 0);
+  }
+  closelog();
+  return 0;
+}
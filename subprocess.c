@@ -14,30 +14,89 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#define _GNU_SOURCE /* syscall */
+
 #include "subprocess.h"
 
 #include <errno.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sysexits.h>
 #include <syslog.h>
 #include <unistd.h>
 
-int childpid = -1; /* default to a bogus pid */
+/* how often to poll for exited children when pidfds are unavailable */
+#define FALLBACK_POLL_MS 10
+#define MAX_EVENTS 64
+
+static struct subprocess* live_children = NULL;
 volatile sig_atomic_t killed_by_us = 0;
 volatile sig_atomic_t fatal_error_in_progress = 0;
+static void (*termination_function)(void) = NULL;
+
+/* Block the signals whose handlers walk live_children while it changes. */
+static void block_signals(sigset_t* old_set) {
+  sigset_t set;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGHUP);
+  sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGQUIT);
+  sigaddset(&set, SIGALRM);
+  sigprocmask(SIG_BLOCK, &set, old_set);
+}
+
+static void restore_signals(const sigset_t* old_set) {
+  sigprocmask(SIG_SETMASK, old_set, NULL);
+}
+
+static void link_child(struct subprocess* sp) {
+  sp->prev = NULL;
+  sp->next = live_children;
+  if (live_children != NULL) live_children->prev = sp;
+  live_children = sp;
+}
+
+static void unlink_child(struct subprocess* sp) {
+  sigset_t old_set;
+
+  block_signals(&old_set);
+  if (sp->prev != NULL) {
+    sp->prev->next = sp->next;
+  } else if (live_children == sp) {
+    live_children = sp->next;
+  }
+  if (sp->next != NULL) sp->next->prev = sp->prev;
+  sp->next = sp->prev = NULL;
+  restore_signals(&old_set);
+}
+
+int subprocess_kill(struct subprocess* sp, int sig) {
+  if (sp->pid <= 0 || sp->exited) return 0;
+  sp->killed = 1;
+  if (killpg(sp->pid, sig) < 0) {
+    /* the child may not have called setsid() yet */
+    if (errno != ESRCH || kill(sp->pid, sig) < 0) return -1;
+  }
+  return 0;
+}
 
 void kill_process_group(void) {
-  int pgid;
+  struct subprocess* sp;
 
   killed_by_us = 1;
-  pgid = getpgid(childpid);
-  if (killpg(pgid, SIGTERM) < 0) {
-    perror("killpg");
-    exit(EX_OSERR);
+  for (sp = live_children; sp != NULL; sp = sp->next) {
+    if (subprocess_kill(sp, SIGTERM) < 0) {
+      perror("killpg");
+      exit(EX_OSERR);
+    }
   }
 }
 
@@ -50,12 +109,15 @@ static void termination_handler(int sig) {
   }
   fatal_error_in_progress = 1;
 
-  if (childpid > 0) {
+  if (live_children != NULL) {
     old_errno = errno;
-    /* we were killed (SIGTERM), so make sure child dies too */
+    /* we were killed (SIGTERM), so make sure children die too */
     kill_process_group();
     errno = old_errno;
   }
+  if (termination_function != NULL) {
+    termination_function();
+  }
 
   signal(sig, SIG_DFL);
   raise(sig);
@@ -63,7 +125,11 @@ static void termination_handler(int sig) {
 
 void install_termination_handler(void);
 void install_termination_handler(void) {
+  static int installed = 0;
   struct sigaction sa, old_sa;
+
+  if (installed) return;
+  installed = 1;
   sa.sa_handler = termination_handler;
   sigemptyset(&sa.sa_mask);
   sigaddset(&sa.sa_mask, SIGINT);
@@ -79,72 +145,384 @@ void install_termination_handler(void) {
   if (old_sa.sa_handler != SIG_IGN) sigaction(SIGTERM, &sa, NULL);
 }
 
-int run_subprocess(char* command, char** args,
-                   void (*pre_wait_function)(void)) {
-  int pid;
-  int status;
+/* Have function called, from the signal handler, if we are killed by
+ * SIGINT, SIGHUP or SIGTERM, whether or not a child is running.
+ */
+void set_termination_function(void (*function)(void)) {
+  termination_function = function;
+  install_termination_handler();
+}
+
+void subprocess_init(struct subprocess* sp) {
+  memset(sp, 0, sizeof(*sp));
+  sp->pid = -1;
+  sp->pidfd = -1;
+  sp->status = -1;
+  sp->kill_signal = SIGTERM;
+  sp->stdout_fd = -1;
+  sp->stderr_fd = -1;
+}
+
+static void add_ms(struct timespec* ts, long ms) {
+  clock_gettime(CLOCK_MONOTONIC, ts);
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (ms % 1000) * 1000000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_nsec -= 1000000000L;
+    ts->tv_sec++;
+  }
+}
 
-  childpid = fork();
-  if (childpid == 0) {
+static int deadline_armed(const struct subprocess* sp) {
+  return sp->deadline.tv_sec != 0 || sp->deadline.tv_nsec != 0;
+}
+
+/* Fork and exec command in a new session, without waiting for it.  Returns
+ * -1 with errno set if the fork failed.
+ */
+int subprocess_start(struct subprocess* sp, char* command, char** args) {
+  sigset_t old_set;
+
+  /* Make sure the child dies if we get killed. */
+  install_termination_handler();
+
+  block_signals(&old_set);
+  sp->pid = fork();
+  if (sp->pid == 0) {
+    /* our siblings are not ours to kill */
+    live_children = NULL;
+    restore_signals(&old_set);
     /* try to detach from parent's process group */
     if (setsid() == -1) {
       syslog(LOG_ERR, "Unable to detach child.  Aborting");
-      return -1;
+      _exit(EX_OSERR);
     }
-    if (execvp(command, args)) {
-      perror("execvp");
-      exit(EX_NOINPUT);
-    } else {
-      /* Control almost certainly will not get to this point, ever. If
-       * the call to execvp returned, instead of switching to a new memory
-       * image, there was a problem. This exit will be collected by the
-       * parent's call to waitpid() below.
-       */
-      exit(EX_UNAVAILABLE);
+    if ((sp->stdout_fd >= 0 && dup2(sp->stdout_fd, STDOUT_FILENO) < 0) ||
+        (sp->stderr_fd >= 0 && dup2(sp->stderr_fd, STDERR_FILENO) < 0)) {
+      perror("dup2");
+      _exit(EX_OSERR);
     }
-  } else if (childpid < 0) {
-    perror("fork");
-    exit(EX_OSERR);
+    execvp(command, args);
+    /* If the call to execvp returned, instead of switching to a new memory
+     * image, there was a problem.  This exit will be collected by the
+     * parent's wait.
+     */
+    perror("execvp");
+    exit(EX_NOINPUT);
+  } else if (sp->pid < 0) {
+    restore_signals(&old_set);
+    return -1;
+  }
+  sp->exited = 0;
+  sp->killed = 0;
+  memset(&sp->deadline, 0, sizeof(sp->deadline));
+  if (sp->timeout_ms > 0) add_ms(&sp->deadline, sp->timeout_ms);
+  link_child(sp);
+  restore_signals(&old_set);
+  return 0;
+}
+
+static void record_exit(struct subprocess* sp, int status) {
+  /* exited normally? */
+  if (WIFEXITED(status)) {
+    /* decode and return exit status */
+    sp->status = WEXITSTATUS(status);
+    syslog(LOG_DEBUG, "child %d exited with status %d", sp->pid, sp->status);
   } else {
-    /* Make sure the child dies if we get killed. */
-    /* Only the parent should do this, of course! */
-    install_termination_handler();
+    /* This formula is a Unix shell convention */
+    sp->status = 128 + WTERMSIG(status);
+    syslog(LOG_DEBUG, "child %d exited via signal %d", sp->pid,
+           WTERMSIG(status));
+  }
+  sp->exited = 1;
+}
+
+/* Block until sp has exited, without reaping it.  Returns -1 if the wait
+ * was interrupted after we killed the child ourselves.
+ */
+static int wait_unreaped(struct subprocess* sp) {
+  siginfo_t info;
 
-    if (pre_wait_function != NULL) {
-      pre_wait_function();
+  while (waitid(P_PID, sp->pid, &info, WEXITED | WNOWAIT) < 0) {
+    if (errno == EINTR) {
+      if (killed_by_us) return -1;
+    } else {
+      perror("waitid");
+      return 0;
     }
+  }
+  sp->pre_reap_function(sp);
+  return 0;
+}
+
+/* Block until sp exits, and return its exit status.  Returns -1 if the wait
+ * was interrupted after we killed the child ourselves.
+ */
+int subprocess_wait(struct subprocess* sp) {
+  pid_t pid = -1;
+  int status;
 
-    /* blocking wait on the child */
-    while ((pid = waitpid(childpid, &status, 0)) < 0) {
+  if (sp->pre_reap_function == NULL || wait_unreaped(sp) == 0) {
+    while ((pid = waitpid(sp->pid, &status, 0)) < 0) {
       if (errno == EINTR) {
         if (killed_by_us) {
           break;
         } /* else restart the loop */
       } else {
         perror("waitpid");
+        break;
+      }
+    }
+  }
+  if (pid > 0) record_exit(sp, status);
+  unlink_child(sp);
+  return sp->exited ? sp->status : -1;
+}
+
+int run_subprocess(char* command, char** args,
+                   void (*pre_wait_function)(void)) {
+  struct subprocess sp;
+  int status;
+
+  subprocess_init(&sp);
+  if (subprocess_start(&sp, command, args) < 0) {
+    perror("fork");
+    exit(EX_OSERR);
+  }
+
+  if (pre_wait_function != NULL) {
+    pre_wait_function();
+  }
+
+  /* blocking wait on the child */
+  status = subprocess_wait(&sp);
+  alarm(0);
+  return status;
+}
+
+static int pidfd_open(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  (void)pid;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/* A supervisor tracks many children started with supervisor_start(), and
+ * reaps them as they exit.  With pidfds (Linux 5.3 and later) each child is
+ * watched by one epoll set; otherwise children are collected with
+ * waitid(P_ALL), so the supervisor must then be the only reaper in the
+ * process.
+ */
+int supervisor_init(struct supervisor* sv) {
+  int fd;
+
+  sv->running = 0;
+  sv->timed = 0;
+  if ((sv->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) return -1;
+  sv->use_pidfd = 0;
+  if ((fd = pidfd_open(getpid())) >= 0) {
+    close(fd);
+    sv->use_pidfd = 1;
+  }
+  return 0;
+}
+
+/* Forget the supervisor's children.  Any still running are neither killed
+ * nor reaped: a caller that killed them, as on a timeout, may not want to
+ * wait for them to die, and they are reaped by init once we exit.
+ */
+void supervisor_close(struct supervisor* sv) {
+  struct subprocess *sp, *next;
+
+  for (sp = live_children; sp != NULL; sp = next) {
+    next = sp->next;
+    if (sp->owner != sv) continue;
+    if (sp->pidfd >= 0) close(sp->pidfd);
+    sp->pidfd = -1;
+    unlink_child(sp);
+  }
+  close(sv->epfd);
+  sv->epfd = -1;
+}
+
+int supervisor_start(struct supervisor* sv, struct subprocess* sp,
+                     char* command, char** args) {
+  struct epoll_event ev;
+  int saved_errno;
+
+  sp->owner = sv;
+  if (subprocess_start(sp, command, args) < 0) return -1;
+  if (sv->use_pidfd) {
+    if ((sp->pidfd = pidfd_open(sp->pid)) >= 0) {
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.ptr = sp;
+      if (epoll_ctl(sv->epfd, EPOLL_CTL_ADD, sp->pidfd, &ev) < 0) {
+        close(sp->pidfd);
+        sp->pidfd = -1;
       }
     }
-    alarm(0);
-    if (pid > 0) {
-      if (pid != childpid) {
-        syslog(LOG_ERR, "childpid %d not returned by waitpid! instead %d",
-               childpid, pid);
-        kill_process_group();
-        exit(EX_OSERR);
+    if (sp->pidfd < 0) {
+      /* we could never reap it, so don't leave it running */
+      saved_errno = errno;
+      subprocess_kill(sp, SIGKILL);
+      waitpid(sp->pid, NULL, 0);
+      unlink_child(sp);
+      errno = saved_errno;
+      return -1;
+    }
+  }
+  sv->running++;
+  if (deadline_armed(sp)) sv->timed++;
+  return 0;
+}
+
+static void finish_child(struct supervisor* sv, struct subprocess* sp,
+                         int status) {
+  record_exit(sp, status);
+  if (sp->pidfd >= 0) {
+    epoll_ctl(sv->epfd, EPOLL_CTL_DEL, sp->pidfd, NULL);
+    close(sp->pidfd);
+    sp->pidfd = -1;
+  }
+  if (deadline_armed(sp)) sv->timed--;
+  unlink_child(sp);
+  sv->running--;
+}
+
+static long ms_until(const struct timespec* deadline,
+                     const struct timespec* now) {
+  return (deadline->tv_sec - now->tv_sec) * 1000 +
+         (deadline->tv_nsec - now->tv_nsec) / 1000000;
+}
+
+/* Apply the kill policy of every child whose deadline has passed, and
+ * return how long until the next deadline, capped at wait_ms.
+ */
+static long enforce_deadlines(struct supervisor* sv, long wait_ms) {
+  struct subprocess* sp;
+  struct timespec now;
+  long left;
+
+  if (sv->timed == 0) return wait_ms;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  for (sp = live_children; sp != NULL; sp = sp->next) {
+    if (sp->owner != sv || !deadline_armed(sp)) continue;
+    if ((left = ms_until(&sp->deadline, &now)) > 0) {
+      if (wait_ms < 0 || left < wait_ms) wait_ms = left;
+      continue;
+    }
+    if (!sp->killed) {
+      syslog(LOG_INFO, "child %d timed out after %ld ms", sp->pid,
+             sp->timeout_ms);
+      subprocess_kill(sp, sp->kill_signal);
+      if (sp->kill_grace_ms > 0 && sp->kill_signal != SIGKILL) {
+        add_ms(&sp->deadline, sp->kill_grace_ms);
+        if (wait_ms < 0 || sp->kill_grace_ms < wait_ms) {
+          wait_ms = sp->kill_grace_ms;
+        }
+        continue;
       }
+    } else {
+      syslog(LOG_INFO, "child %d still running, sending SIGKILL", sp->pid);
+      subprocess_kill(sp, SIGKILL);
+    }
+    memset(&sp->deadline, 0, sizeof(sp->deadline));
+    sv->timed--;
+  }
+  return wait_ms;
+}
 
-      /* exited normally? */
-      if (WIFEXITED(status)) {
-        /* decode and return exit sttus */
-        status = WEXITSTATUS(status);
-        syslog(LOG_DEBUG, "child exited with status %d", status);
-      } else {
-        /* This formula is a Unix shell convention */
-        status = 128 + WTERMSIG(status);
-        syslog(LOG_DEBUG, "child exited via signal %d", WTERMSIG(status));
+static long ms_since(const struct timespec* start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return ms_until(&now, start);
+}
+
+static struct subprocess* find_child(struct supervisor* sv, pid_t pid) {
+  struct subprocess* sp;
+
+  for (sp = live_children; sp != NULL; sp = sp->next) {
+    if (sp->owner == sv && sp->pid == pid) return sp;
+  }
+  return NULL;
+}
+
+/* Collect exited children without blocking. */
+static int reap_exited(struct supervisor* sv, struct subprocess** done,
+                       int max_done) {
+  struct epoll_event events[MAX_EVENTS];
+  struct subprocess* sp;
+  siginfo_t info;
+  int i, n, status;
+  int ndone = 0;
+  pid_t pid;
+
+  if (sv->use_pidfd) {
+    if (max_done > MAX_EVENTS) max_done = MAX_EVENTS;
+    if ((n = epoll_wait(sv->epfd, events, max_done, 0)) < 0) {
+      return errno == EINTR ? 0 : -1;
+    }
+    for (i = 0; i < n; i++) {
+      /* a readable pidfd means the child has exited, but is not reaped */
+      sp = events[i].data.ptr;
+      if (sp->pre_reap_function != NULL) sp->pre_reap_function(sp);
+      if (waitpid(sp->pid, &status, WNOHANG) > 0) {
+        finish_child(sv, sp, status);
+        done[ndone++] = sp;
+      }
+    }
+  } else {
+    while (ndone < max_done) {
+      memset(&info, 0, sizeof(info));
+      if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) < 0 ||
+          (pid = info.si_pid) == 0)
+        break;
+      if ((sp = find_child(sv, pid)) != NULL && sp->pre_reap_function != NULL)
+        sp->pre_reap_function(sp);
+      if (waitpid(pid, &status, WNOHANG) > 0 && sp != NULL) {
+        finish_child(sv, sp, status);
+        done[ndone++] = sp;
       }
     }
-    childpid = -1;
   }
-  return status;
+  return ndone;
+}
+
+/* Wait up to timeout_ms (or forever, if negative) for children of sv to
+ * exit, enforcing their kill policies meanwhile.  Up to max_done exited
+ * children are stored in done, and their number is returned.  Returns 0 at
+ * once if there are no children left, and -1 on error.
+ */
+int supervisor_reap(struct supervisor* sv, struct subprocess** done,
+                    int max_done, long timeout_ms) {
+  struct timespec start;
+  struct epoll_event event;
+  long wait_ms;
+  int ndone;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (;;) {
+    if ((ndone = reap_exited(sv, done, max_done)) != 0) return ndone;
+    if (sv->running == 0) return 0;
+
+    wait_ms = timeout_ms;
+    if (timeout_ms >= 0 && (wait_ms = timeout_ms - ms_since(&start)) < 0) {
+      wait_ms = 0;
+    }
+    /* kill policies apply even when the caller is only polling */
+    wait_ms = enforce_deadlines(sv, wait_ms);
+    if (timeout_ms >= 0 && wait_ms == 0) return 0;
+    if (!sv->use_pidfd && (wait_ms < 0 || wait_ms > FALLBACK_POLL_MS)) {
+      wait_ms = FALLBACK_POLL_MS;
+    }
+    /* With no pidfds the epoll set is empty, and this is just a nap. */
+    if (epoll_wait(sv->epfd, &event, 1, wait_ms) < 0 && errno != EINTR) {
+      return -1;
+    }
+  }
 }
@@ -1,7 +1,70 @@
 #ifndef __CRONUTILS_SUBPROCESS_H
 #define __CRONUTILS_SUBPROCESS_H
 
+#include <sys/types.h>
+#include <time.h>
+
+struct supervisor;
+
+/* One supervised child.  Set up with subprocess_init(), then adjust the
+ * kill policy before starting it.
+ */
+struct subprocess {
+  /* all live children, so that they can be killed if we are */
+  struct subprocess* next;
+  struct subprocess* prev;
+  struct supervisor* owner;
+
+  pid_t pid;
+  int pidfd;
+  int exited;
+  int killed;
+  /* exit status, or 128 + signal number, once exited */
+  int status;
+
+  /* kill policy: after timeout_ms send kill_signal to the process group,
+   * then SIGKILL if it is still running kill_grace_ms later.  Zero disables
+   * the timeout and the SIGKILL escalation respectively.
+   */
+  long timeout_ms;
+  int kill_signal;
+  long kill_grace_ms;
+  struct timespec deadline;
+
+  /* if not -1, the child's stdout and stderr are redirected to these */
+  int stdout_fd;
+  int stderr_fd;
+
+  /* if set, called once the child has exited but before it is reaped,
+   * while its /proc entry is still there
+   */
+  void (*pre_reap_function)(struct subprocess* sp);
+  void* data;
+};
+
+/* Waits on many children at once, using pidfds where the kernel has them. */
+struct supervisor {
+  int epfd;
+  int use_pidfd;
+  /* children started and not yet reaped, and those with a deadline */
+  int running;
+  int timed;
+};
+
+void subprocess_init(struct subprocess* sp);
+int subprocess_start(struct subprocess* sp, char* command, char** args);
+int subprocess_kill(struct subprocess* sp, int sig);
+int subprocess_wait(struct subprocess* sp);
+
+int supervisor_init(struct supervisor* sv);
+int supervisor_start(struct supervisor* sv, struct subprocess* sp,
+                     char* command, char** args);
+int supervisor_reap(struct supervisor* sv, struct subprocess** done,
+                    int max_done, long timeout_ms);
+void supervisor_close(struct supervisor* sv);
+
 void kill_process_group(void);
+void set_termination_function(void (*function)(void));
 int run_subprocess(char* command, char** args, void (*pre_wait_function)(void));
 
 #endif /* __CRONUTILS_SUBPROCESS_H */
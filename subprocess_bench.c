@@ -0,0 +1,180 @@
+/*
+Copyright 2010 Google, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/* Measures how many short-lived children per second the supervisor can
+ * start and reap, against run_subprocess() running them one at a time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sysexits.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "subprocess.h"
+
+static char true_command[] = "true";
+static char* default_args[] = {true_command, NULL};
+
+static void usage(char* prog) {
+  fprintf(stderr,
+          "Usage: %s [options] [command [arg [arg] ...]]\n\n"
+          "Runs command (default: true) many times under the subprocess\n"
+          "supervisor, and reports the throughput.\n"
+          "\noptions:\n"
+          " -n count  total number of children to run (default 5000)\n"
+          " -j count  children to keep running at once (default 256)\n"
+          " -t ms     per-child timeout (default none)\n"
+          " -p        poll the supervisor without blocking\n"
+          " -s        also time running them serially\n"
+          " -h        print this help\n",
+          prog);
+}
+
+static double elapsed(const struct timespec* start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void report(const char* name, int count, int failed, double secs) {
+  printf("%-10s %6d children %6d failed %8.3f s %10.1f children/s\n", name,
+         count, failed, secs, count / secs);
+}
+
+static void run_supervised(char** args, int total, int jobs, long timeout_ms,
+                           int poll) {
+  struct supervisor sv;
+  struct subprocess* slots;
+  struct subprocess** free_slots;
+  struct subprocess* done[64];
+  struct timespec start, nap;
+  int nfree = jobs;
+  int started = 0, finished = 0, failed = 0;
+  int i, n;
+
+  slots = calloc(jobs, sizeof(struct subprocess));
+  free_slots = calloc(jobs, sizeof(struct subprocess*));
+  if (slots == NULL || free_slots == NULL) {
+    perror("calloc");
+    exit(EX_OSERR);
+  }
+  for (i = 0; i < jobs; i++) free_slots[i] = &slots[i];
+  if (supervisor_init(&sv) < 0) {
+    perror("supervisor_init");
+    exit(EX_OSERR);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (finished < total) {
+    while (started < total && nfree > 0) {
+      struct subprocess* sp = free_slots[--nfree];
+      subprocess_init(sp);
+      sp->timeout_ms = timeout_ms;
+      if (supervisor_start(&sv, sp, args[0], args) < 0) {
+        perror("supervisor_start");
+        /* with nothing to reap, waiting won't free up any resources */
+        if (sv.running == 0) exit(EX_OSERR);
+        free_slots[nfree++] = sp;
+        break;
+      }
+      started++;
+    }
+    if ((n = supervisor_reap(&sv, done, 64, poll ? 0 : -1)) < 0) {
+      perror("supervisor_reap");
+      exit(EX_OSERR);
+    }
+    if (poll && n == 0) {
+      /* as a caller with other work to do between polls would */
+      nap.tv_sec = 0;
+      nap.tv_nsec = 1000000;
+      nanosleep(&nap, NULL);
+    }
+    for (i = 0; i < n; i++) {
+      if (done[i]->status != 0) failed++;
+      free_slots[nfree++] = done[i];
+    }
+    finished += n;
+  }
+  report(sv.use_pidfd ? "pidfd" : "waitpid", total, failed, elapsed(&start));
+  supervisor_close(&sv);
+  free(slots);
+  free(free_slots);
+}
+
+static void run_serial(char** args, int total) {
+  struct timespec start;
+  int i, failed = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < total; i++) {
+    if (run_subprocess(args[0], args, NULL) != 0) failed++;
+  }
+  report("serial", total, failed, elapsed(&start));
+}
+
+int main(int argc, char** argv) {
+  int arg;
+  int total = 5000;
+  int jobs = 256;
+  long timeout_ms = 0;
+  int serial = 0;
+  int poll = 0;
+  char** args = default_args;
+
+  while ((arg = getopt(argc, argv, "+n:j:t:psh")) > 0) {
+    switch (arg) {
+      case 'n':
+        total = atoi(optarg);
+        break;
+      case 'j':
+        jobs = atoi(optarg);
+        break;
+      case 't':
+        timeout_ms = atol(optarg);
+        break;
+      case 'p':
+        poll = 1;
+        break;
+      case 's':
+        serial = 1;
+        break;
+      case 'h':
+        usage(argv[0]);
+        exit(EXIT_SUCCESS);
+        break;
+      default:
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+  if (total <= 0 || jobs <= 0) {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if (optind < argc) args = &argv[optind];
+
+  openlog(argv[0], LOG_ODELAY | LOG_PID | LOG_NOWAIT, LOG_USER);
+  setlogmask(LOG_UPTO(LOG_INFO));
+
+  run_supervised(args, total, jobs, timeout_ms, poll);
+  if (serial) run_serial(args, total);
+
+  closelog();
+  return 0;
+}
@@ -0,0 +1,404 @@
+/*
+Copyright 2010 Google, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#define _GNU_SOURCE /* _SC_NPROCESSORS_CONF */
+
+#include "taskstats.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sysexits.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <linux/genetlink.h>
+#include <linux/netlink.h>
+#include <linux/taskstats.h>
+
+#include "subprocess.h"
+
+#define RECV_BUFSIZE (1 << 20)
+#define MAX_ANCESTRY 64
+#define MAX_PENDING 4096
+
+union nl_message {
+  struct nlmsghdr hdr;
+  char buf[65536];
+};
+
+/* Pids known to be descendants of ours; grows as the job forks. */
+static pid_t* descendants = NULL;
+static size_t ndescendants = 0, descendants_size = 0;
+
+static void add_descendant(pid_t pid) {
+  if (ndescendants == descendants_size) {
+    descendants_size = descendants_size ? descendants_size * 2 : 64;
+    descendants = realloc(descendants, descendants_size * sizeof(pid_t));
+    if (descendants == NULL) {
+      perror("realloc");
+      exit(EX_OSERR);
+    }
+  }
+  descendants[ndescendants++] = pid;
+}
+
+/* Exit records whose parent had already left /proc when they were read.
+ * They are kept in case the parent's own exit record, whose parent is
+ * known, shows it to have been one of ours.
+ */
+static struct taskstats* pending = NULL;
+static size_t npending = 0, pending_size = 0;
+
+static void add_pending(const struct taskstats* ts) {
+  if (npending == MAX_PENDING) {
+    syslog(LOG_DEBUG, "too many unattributed exits, dropping task %u",
+           ts->ac_pid);
+    return;
+  }
+  if (npending == pending_size) {
+    pending_size = pending_size ? pending_size * 2 : 64;
+    pending = realloc(pending, pending_size * sizeof(struct taskstats));
+    if (pending == NULL) {
+      perror("realloc");
+      exit(EX_OSERR);
+    }
+  }
+  pending[npending++] = *ts;
+}
+
+static int known_descendant(pid_t pid) {
+  size_t i;
+
+  if (pid == getpid()) return 1;
+  for (i = 0; i < ndescendants; i++) {
+    if (descendants[i] == pid) return 1;
+  }
+  return 0;
+}
+
+static pid_t parent_of(pid_t pid) {
+  char path[64];
+  char buf[1024];
+  char* p;
+  FILE* f;
+  size_t n;
+  int ppid;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  if ((f = fopen(path, "r")) == NULL) return -1;
+  n = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[n] = '\0';
+  /* the command name may itself contain parentheses */
+  if ((p = strrchr(buf, ')')) == NULL) return -1;
+  if (sscanf(p + 1, " %*c %d", &ppid) != 1) return -1;
+  return ppid;
+}
+
+/* Exit records arrive for every task on the host, so decide whether one
+ * belongs to the job by its parent.  We are a child subreaper, so the
+ * parent of an exiting descendant is either us or a descendant that was
+ * alive when it exited.  Returns -1 if an ancestor has since been reaped,
+ * so that its ancestry can no longer be read from /proc.
+ */
+static int is_descendant(pid_t ppid) {
+  pid_t chain[MAX_ANCESTRY];
+  int i, n = 0;
+  pid_t p = ppid;
+
+  while (n < MAX_ANCESTRY && p > 1) {
+    if (known_descendant(p)) {
+      for (i = 0; i < n; i++) add_descendant(chain[i]);
+      return 1;
+    }
+    chain[n++] = p;
+    if ((p = parent_of(p)) < 0) return -1;
+  }
+  return 0;
+}
+
+static int nl_send(int sock, int type, int flags, int cmd, int attr_type,
+                   const void* data, int len) {
+  union nl_message msg;
+  struct genlmsghdr* genl;
+  struct nlattr* na;
+  struct sockaddr_nl addr;
+
+  memset(&msg.hdr, 0, NLMSG_SPACE(GENL_HDRLEN));
+  msg.hdr.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+  msg.hdr.nlmsg_type = type;
+  msg.hdr.nlmsg_flags = NLM_F_REQUEST | flags;
+  genl = NLMSG_DATA(&msg.hdr);
+  genl->cmd = cmd;
+  genl->version = 1;
+  na = (struct nlattr*)(void*)(msg.buf + msg.hdr.nlmsg_len);
+  na->nla_type = attr_type;
+  na->nla_len = NLA_HDRLEN + len;
+  memcpy(msg.buf + msg.hdr.nlmsg_len + NLA_HDRLEN, data, len);
+  msg.hdr.nlmsg_len += NLA_ALIGN(na->nla_len);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  return sendto(sock, msg.buf, msg.hdr.nlmsg_len, 0, (struct sockaddr*)&addr,
+                sizeof(addr));
+}
+
+#define FOR_EACH_ATTR(na, start, len)                                      \
+  for (na = (struct nlattr*)(void*)(start);                                \
+       (char*)(na) + NLA_HDRLEN <= (char*)(start) + (len) &&               \
+       na->nla_len >= NLA_HDRLEN &&                                        \
+       (char*)(na) + na->nla_len <= (char*)(start) + (len);                \
+       na = (struct nlattr*)(void*)((char*)(na) + NLA_ALIGN(na->nla_len)))
+
+#define NLA_DATA(na) ((char*)(na) + NLA_HDRLEN)
+#define GENL_ATTRS(hdr) ((char*)NLMSG_DATA(hdr) + GENL_HDRLEN)
+#define GENL_ATTRLEN(hdr) ((int)NLMSG_PAYLOAD(hdr, GENL_HDRLEN))
+
+static int get_family_id(int sock) {
+  union nl_message msg;
+  struct nlattr* na;
+  struct nlmsgerr* err;
+  const char name[] = TASKSTATS_GENL_NAME;
+  __u16 id;
+  ssize_t len;
+
+  if (nl_send(sock, GENL_ID_CTRL, 0, CTRL_CMD_GETFAMILY, CTRL_ATTR_FAMILY_NAME,
+              name, sizeof(name)) < 0) {
+    return -1;
+  }
+  if ((len = recv(sock, msg.buf, sizeof(msg.buf), 0)) < 0) return -1;
+  if (!NLMSG_OK(&msg.hdr, (size_t)len)) return -1;
+  if (msg.hdr.nlmsg_type == NLMSG_ERROR) {
+    err = NLMSG_DATA(&msg.hdr);
+    errno = -err->error;
+    return -1;
+  }
+  FOR_EACH_ATTR(na, GENL_ATTRS(&msg.hdr), GENL_ATTRLEN(&msg.hdr)) {
+    if (na->nla_type == CTRL_ATTR_FAMILY_ID) {
+      memcpy(&id, NLA_DATA(na), sizeof(id));
+      return id;
+    }
+  }
+  errno = ENOENT;
+  return -1;
+}
+
+/* Count the exit of a descendant, and of any pending records that this
+ * shows to be descendants too.
+ */
+static void count_taskstats(const struct taskstats* ts,
+                            struct taskstats_totals* totals) {
+  struct taskstats child;
+  size_t i;
+
+  syslog(LOG_DEBUG, "task %u (%s) exited", ts->ac_pid, ts->ac_comm);
+  totals->tasks++;
+  totals->cpu_delay += ts->cpu_delay_total;
+  totals->blkio_delay += ts->blkio_delay_total;
+  totals->swapin_delay += ts->swapin_delay_total;
+  totals->freepages_delay += ts->freepages_delay_total;
+  totals->read_bytes += ts->read_bytes;
+  totals->write_bytes += ts->write_bytes;
+  if (ts->hiwater_rss * 1024. > totals->hiwater_rss)
+    totals->hiwater_rss = ts->hiwater_rss * 1024.;
+  if (ts->hiwater_vm * 1024. > totals->hiwater_vm)
+    totals->hiwater_vm = ts->hiwater_vm * 1024.;
+
+  add_descendant(ts->ac_pid);
+  for (i = 0; i < npending;) {
+    if (pending[i].ac_ppid != ts->ac_pid) {
+      i++;
+      continue;
+    }
+    child = pending[i];
+    pending[i] = pending[--npending];
+    count_taskstats(&child, totals);
+    /* the recursion may have reordered pending */
+    i = 0;
+  }
+}
+
+static void add_taskstats(struct nlattr* stats_attr,
+                          struct taskstats_totals* totals) {
+  struct taskstats ts;
+  size_t len = stats_attr->nla_len - NLA_HDRLEN;
+
+  memset(&ts, 0, sizeof(ts));
+  memcpy(&ts, NLA_DATA(stats_attr), len < sizeof(ts) ? len : sizeof(ts));
+  switch (is_descendant(ts.ac_ppid)) {
+    case 1:
+      count_taskstats(&ts, totals);
+      break;
+    case -1:
+      add_pending(&ts);
+      break;
+    default:
+      break;
+  }
+}
+
+/* Drain the socket of exit records.  Only per-task (AGGR_PID) records are
+ * counted, as the per-thread-group ones would count threads twice.
+ * Returns the number of records read, or -1 on error.
+ */
+static int read_taskstats(int sock, int family,
+                          struct taskstats_totals* totals) {
+  union nl_message msg;
+  struct nlmsghdr* hdr;
+  struct nlattr *na, *inner;
+  ssize_t len;
+  size_t left;
+  int n = 0;
+
+  for (;;) {
+    if ((len = recv(sock, msg.buf, sizeof(msg.buf), MSG_DONTWAIT)) < 0) {
+      if (errno == ENOBUFS) {
+        syslog(LOG_WARNING, "taskstats records were dropped, totals are low");
+        continue;
+      }
+      if (errno == EAGAIN || errno == EINTR) break;
+      perror("recv taskstats");
+      return -1;
+    }
+    left = len;
+    for (hdr = &msg.hdr; NLMSG_OK(hdr, left); hdr = NLMSG_NEXT(hdr, left)) {
+      if (hdr->nlmsg_type != family) continue;
+      FOR_EACH_ATTR(na, GENL_ATTRS(hdr), GENL_ATTRLEN(hdr)) {
+        if (na->nla_type != TASKSTATS_TYPE_AGGR_PID) continue;
+        FOR_EACH_ATTR(inner, NLA_DATA(na), na->nla_len - NLA_HDRLEN) {
+          if (inner->nla_type == TASKSTATS_TYPE_STATS) {
+            add_taskstats(inner, totals);
+            n++;
+          }
+        }
+      }
+    }
+  }
+  return n;
+}
+
+/* Subscribe to exit records of tasks on all CPUs.  This needs
+ * CAP_NET_ADMIN; returns the socket, or -1 if taskstats are unavailable.
+ */
+static int open_taskstats(int* family, char* cpumask, size_t len) {
+  union nl_message msg;
+  struct nlmsgerr* err;
+  struct sockaddr_nl addr;
+  int sock;
+  int bufsize = RECV_BUFSIZE;
+  ssize_t n;
+
+  if ((sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC)) <
+      0)
+    return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) goto fail;
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  if ((*family = get_family_id(sock)) < 0) goto fail;
+
+  snprintf(cpumask, len, "0-%ld", sysconf(_SC_NPROCESSORS_CONF) - 1);
+  if (nl_send(sock, *family, NLM_F_ACK, TASKSTATS_CMD_GET,
+              TASKSTATS_CMD_ATTR_REGISTER_CPUMASK, cpumask,
+              strlen(cpumask) + 1) < 0)
+    goto fail;
+  /* wait for the acknowledgement, ignoring any early exit records */
+  for (;;) {
+    if ((n = recv(sock, msg.buf, sizeof(msg.buf), 0)) < 0) {
+      if (errno == EINTR || errno == ENOBUFS) continue;
+      goto fail;
+    }
+    if (NLMSG_OK(&msg.hdr, (size_t)n) && msg.hdr.nlmsg_type == NLMSG_ERROR) {
+      err = NLMSG_DATA(&msg.hdr);
+      if (err->error == 0) return sock;
+      errno = -err->error;
+      goto fail;
+    }
+  }
+fail:
+  close(sock);
+  return -1;
+}
+
+/* Run the command in sp like subprocess_start() and subprocess_wait(),
+ * collecting the delay accounting and IO of the command and all its
+ * descendants as they exit.  If taskstats are unavailable, totals->tasks is
+ * set to -1 and nothing is collected.
+ */
+int run_subprocess_taskstats(struct subprocess* sp, char* command,
+                             char** args, struct taskstats_totals* totals) {
+  struct supervisor sv;
+  struct subprocess* done;
+  struct pollfd fds[2];
+  char cpumask[32];
+  int sock, family;
+  int n;
+
+  memset(totals, 0, sizeof(*totals));
+  if ((sock = open_taskstats(&family, cpumask, sizeof(cpumask))) < 0) {
+    syslog(LOG_WARNING, "taskstats unavailable: %s", strerror(errno));
+    totals->tasks = -1;
+    if (subprocess_start(sp, command, args) < 0) {
+      perror("fork");
+      exit(EX_OSERR);
+    }
+    return subprocess_wait(sp);
+  }
+  if (supervisor_init(&sv) < 0) {
+    perror("supervisor_init");
+    exit(EX_OSERR);
+  }
+  /* orphaned descendants are reparented to us, keeping them traceable */
+  prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0);
+
+  if (supervisor_start(&sv, sp, command, args) < 0) {
+    perror("fork");
+    exit(EX_OSERR);
+  }
+  add_descendant(sp->pid);
+
+  fds[0].fd = sv.epfd;
+  fds[0].events = POLLIN;
+  fds[1].fd = sock;
+  fds[1].events = POLLIN;
+  while ((n = supervisor_reap(&sv, &done, 1, 0)) == 0) {
+    if (poll(fds, 2, sv.use_pidfd ? -1 : 10) < 0 && errno != EINTR) {
+      perror("poll");
+      break;
+    }
+    if (fds[1].revents & POLLIN) read_taskstats(sock, family, totals);
+  }
+  /* the child's own record is queued before it can be reaped */
+  read_taskstats(sock, family, totals);
+  if (npending > 0) {
+    syslog(LOG_DEBUG, "%lu exits could not be attributed to the job",
+           (unsigned long)npending);
+    npending = 0;
+  }
+
+  nl_send(sock, family, 0, TASKSTATS_CMD_GET,
+          TASKSTATS_CMD_ATTR_DEREGISTER_CPUMASK, cpumask, strlen(cpumask) + 1);
+  close(sock);
+  supervisor_close(&sv);
+  return n > 0 ? sp->status : -1;
+}
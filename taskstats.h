@@ -0,0 +1,40 @@
+/*
+Copyright 2010 Google, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef __CRONUTILS_TASKSTATS_H
+#define __CRONUTILS_TASKSTATS_H
+
+#include "subprocess.h"
+
+/* Delay accounting and IO totals over every task of a job that exited
+ * while it ran.  Delays are in nanoseconds, sizes in bytes.
+ */
+struct taskstats_totals {
+  long tasks;
+  double cpu_delay;
+  double blkio_delay;
+  double swapin_delay;
+  double freepages_delay;
+  double read_bytes;
+  double write_bytes;
+  double hiwater_rss;
+  double hiwater_vm;
+};
+
+int run_subprocess_taskstats(struct subprocess* sp, char* command,
+                             char** args, struct taskstats_totals* totals);
+
+#endif /* __CRONUTILS_TASKSTATS_H */
@@ -0,0 +1,15 @@
+#!/bin/sh
+
+runlock -d -f db -s export sleep 3 &
+sleep 1
+
+# a shared lock and an unrelated exclusive lock don't conflict
+runlock -d -t 1 -s export -f other true
+echo $?
+
+# all or nothing: db is taken, so other must not be held afterwards
+runlock -d -t 1 -f other -f db true
+echo $?
+runlock -d -t 1 -f other true
+echo $?
+wait
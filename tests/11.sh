@@ -0,0 +1,12 @@
+#!/bin/sh
+
+runalarm -d -t 10 -s 2 -o /bin/bash -c 'for i in $(seq 1 5); do echo $i; done; sleep 7; echo "exited"'
+r=$?
+# Should be killed by the stall watchdog, sigvtalrm, before the timeout
+if [ $r -eq 154 ]; then
+	exit 0
+elif [ $r -eq 0 ]; then
+	exit 1
+else
+	exit $r
+fi
@@ -0,0 +1,22 @@
+#!/bin/sh
+
+# fails with 75 twice, then succeeds
+runstat -d -f foo -r 3 -R 75,SIGKILL -b 0.1 bash -c 'n=$(cat count 2>/dev/null || echo 0); n=$((n + 1)); echo $n > count; [ $n -ge 3 ] || exit 75'
+echo $?
+grep '^bash,attempts,' foo
+grep -c '^bash,attempt_elapsed-' foo
+
+# a status not listed is not retried
+runstat -d -f foo -r 3 -R 75 -b 0.1 false
+echo $?
+grep '^false,attempts,' foo
+
+# nor is anything once the enclosing runalarm's deadline has passed
+RUNALARM_DEADLINE=1 runstat -d -f foo -r 3 -b 0.1 false
+echo $?
+grep '^false,attempts,' foo
+
+# runalarm -t 0 has no deadline to stop the retries
+runalarm -t 0 runstat -d -f foo -r 2 -b 0.1 false
+echo $?
+grep '^false,attempts,' foo
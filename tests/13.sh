@@ -0,0 +1,19 @@
+#!/bin/sh
+
+runlock -f lock runstat -f foo sleep 3 &
+sleep 0.5
+runalarm -t 60 runlock -t 10 -f lock true &
+sleep 1
+
+# one row per job, showing the outermost tool and the innermost command
+runtop -n 1 | grep -E ' (sleep 3|true)$' | tr -s ' ' | cut -d ' ' -f 2,3,6-
+wait
+runtop -n 1 | grep -cE ' (sleep 3|true)$'
+
+# a tool that is killed frees its slot on the way out
+runlock -f lock sleep 30 &
+sleep 1
+kill -TERM $!
+wait
+runtop -n 1 | grep -c ' sleep 30$'
+exit 0
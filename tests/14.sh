@@ -0,0 +1,5 @@
+#!/bin/sh
+
+# children over their timeout are killed even when the supervisor is only
+# polled, without blocking
+subprocess_bench -n 2 -j 2 -t 200 -p sleep 3 | awk '{ print $4, $6 < 2 }'
@@ -0,0 +1,27 @@
+#!/bin/sh
+
+# keep two locks almost always taken, out of step with each other, so
+# that a runlock wanting both keeps getting one and backing off for the
+# other
+(while [ ! -e stop ]; do runlock -f x sleep 0.3; done) &
+x=$!
+sleep 0.15
+(while [ ! -e stop ]; do runlock -f y sleep 0.7; done) &
+y=$!
+sleep 0.5
+
+# it must either get both locks or time out, never fail otherwise
+runlock -d -t 5 -f x -f y true 2> log
+r=$?
+touch stop
+wait $x $y
+if [ $r -ne 0 ] && [ $r -ne 73 ]; then
+	cat log
+	exit 1
+fi
+# and it went through several rounds of backing off
+if [ $(grep -c 'is locked, waiting' log) -lt 2 ]; then
+	cat log
+	exit 1
+fi
+exit 0
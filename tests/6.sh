@@ -0,0 +1,22 @@
+#!/bin/sh
+
+runstat -d -f foo -p cpu=100 -p memory=100,100 -w 1 bash -c 'for i in $(seq 1 5); do echo $i; done'
+r=$?
+
+if [ $r -ne 0 ]; then
+	exit 1
+fi
+
+# malformed limits and waits are refused
+for opt in "-p io=10,-5" "-p cpu=nan" "-w -1"; do
+	runstat -f foo $opt true 2>/dev/null
+	if [ $? -ne 65 ]; then
+		echo "accepted $opt"
+		exit 1
+	fi
+done
+
+grep -q 'bash,admission_wait,' foo && exit 0
+
+cat foo
+exit 1
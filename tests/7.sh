@@ -0,0 +1,18 @@
+#!/bin/sh
+
+runstat -d -x sock -f . &
+exporter=$!
+trap "kill $exporter" 0
+sleep 1
+
+runstat -d -f foo.stat bash -c 'for i in $(seq 1 5); do echo $i; done; exit 5'
+if [ $? -ne 5 ]; then
+	exit 1
+fi
+
+command -v curl > /dev/null || exit 0
+curl -s --unix-socket sock http://localhost/metrics > metrics
+grep -q 'runstat{job="foo",variable="exit_status",units=""} 5' metrics && exit 0
+
+cat metrics
+exit 1
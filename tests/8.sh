@@ -0,0 +1,27 @@
+#!/bin/sh
+
+runstat -d -T -f foo bash -c 'for i in $(seq 1 5); do echo $i; done; exit 5'
+r=$?
+
+if [ $r -ne 5 ]; then
+	exit 1
+fi
+
+# taskstats needs CAP_NET_ADMIN; without it only the usual statistics appear
+grep -q 'bash,exit_status,5' foo || { cat foo; exit 1; }
+if grep -q 'bash,tasks,' foo; then
+	grep -q 'bash,delay-cpu,' foo || { cat foo; exit 1; }
+fi
+
+# exits are still counted when runstat reads them only after the
+# intermediate shells have been reaped
+runstat -T -f bar sh -c 'sleep 1; sh -c "sh -c /bin/true; /bin/true"; sleep 1' &
+sleep 0.5
+kill -STOP $!
+sleep 1.5
+kill -CONT $!
+wait
+if grep -q 'sh,tasks,' bar; then
+	grep -q 'sh,tasks,7,' bar || { cat bar; exit 1; }
+fi
+exit 0
@@ -0,0 +1,15 @@
+#!/bin/sh
+
+runstat -d -f foo bash -c 'for i in $(seq 1 5); do echo $i; done; head -c 4096 /dev/zero > bar'
+r=$?
+
+if [ $r -ne 0 ]; then
+	exit 1
+fi
+
+# the child's /proc/<pid>/io is read after it exits, before it is reaped
+grep -q 'bash,io_chars-write,' foo && grep -q 'bash,sched-run_delay,' foo &&
+  grep -q 'bash,sched-ctx_switch_voluntary,' foo && exit 0
+
+cat foo
+exit 1
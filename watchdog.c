@@ -0,0 +1,299 @@
+/*
+Copyright 2010 Google, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#define _GNU_SOURCE /* st_mtim */
+
+#include "watchdog.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sysexits.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "subprocess.h"
+
+/* how often to look for CPU and heartbeat progress, in milliseconds */
+#define CHECK_INTERVAL_MS 1000
+
+enum job_membership { UNKNOWN, VISITING, IN_JOB, NOT_IN_JOB };
+
+struct proc_times {
+  pid_t pid;
+  pid_t ppid;
+  double ticks;
+  /* index of the parent in the sorted table, or -1 */
+  int parent;
+  enum job_membership membership;
+};
+
+static int compare_pids(const void* a, const void* b) {
+  const struct proc_times* pa = a;
+  const struct proc_times* pb = b;
+
+  return pa->pid < pb->pid ? -1 : pa->pid > pb->pid;
+}
+
+/* Sum the CPU time of root and all its descendants.  Tools like runlock
+ * start their command in a new session, so the job's processes are found
+ * by parentage rather than by process group.  Each process's chain of
+ * ancestors is walked only until it meets one already decided, so this
+ * is O(n log n) in the number of processes.
+ */
+static double job_cpu_ticks(pid_t root) {
+  static struct proc_times* procs = NULL;
+  static int* chain = NULL;
+  static size_t size = 0;
+  struct proc_times key;
+  struct proc_times* found;
+  size_t n = 0, i;
+  size_t depth;
+  DIR* dir;
+  struct dirent* de;
+  char path[64], buf[1024], *p;
+  FILE* f;
+  size_t len;
+  int pid, ppid, j;
+  enum job_membership membership;
+  unsigned long utime, stime;
+  long cutime, cstime;
+  double total = 0;
+
+  if ((dir = opendir("/proc")) == NULL) return 0;
+  while ((de = readdir(dir)) != NULL) {
+    if (!isdigit((unsigned char)de->d_name[0])) continue;
+    pid = atoi(de->d_name);
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if ((f = fopen(path, "r")) == NULL) continue;
+    len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = '\0';
+    /* the command name may itself contain parentheses */
+    if ((p = strrchr(buf, ')')) == NULL) continue;
+    if (sscanf(p + 1,
+               " %*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %ld %ld",
+               &ppid, &utime, &stime, &cutime, &cstime) != 5)
+      continue;
+    if (n == size) {
+      size = size ? size * 2 : 256;
+      procs = realloc(procs, size * sizeof(*procs));
+      chain = realloc(chain, size * sizeof(*chain));
+      if (procs == NULL || chain == NULL) {
+        perror("realloc");
+        exit(EX_OSERR);
+      }
+    }
+    procs[n].pid = pid;
+    procs[n].ppid = ppid;
+    procs[n].ticks = (double)utime + stime + cutime + cstime;
+    procs[n].membership = pid == root ? IN_JOB : UNKNOWN;
+    n++;
+  }
+  closedir(dir);
+
+  qsort(procs, n, sizeof(*procs), compare_pids);
+  for (i = 0; i < n; i++) {
+    key.pid = procs[i].ppid;
+    found = bsearch(&key, procs, n, sizeof(*procs), compare_pids);
+    procs[i].parent = found != NULL ? (int)(found - procs) : -1;
+  }
+
+  for (i = 0; i < n; i++) {
+    /* climb until an ancestor whose membership is known */
+    depth = 0;
+    for (j = i; j >= 0 && procs[j].membership == UNKNOWN;
+         j = procs[j].parent) {
+      procs[j].membership = VISITING;
+      chain[depth++] = j;
+    }
+    /* a pid reused while we read /proc could make a loop */
+    membership = j >= 0 && procs[j].membership == IN_JOB ? IN_JOB : NOT_IN_JOB;
+    while (depth > 0) procs[chain[--depth]].membership = membership;
+    if (procs[i].membership == IN_JOB) total += procs[i].ticks;
+  }
+  return total;
+}
+
+static int heartbeat_changed(const char* heartbeat, struct timespec* seen) {
+  struct stat st;
+
+  if (stat(heartbeat, &st) < 0) return 0;
+  if (st.st_mtim.tv_sec == seen->tv_sec && st.st_mtim.tv_nsec == seen->tv_nsec)
+    return 0;
+  *seen = st.st_mtim;
+  return 1;
+}
+
+static long ms_since(const struct timespec* start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000 +
+         (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void make_pipe(int fds[2]) {
+  if (pipe(fds) < 0) {
+    perror("pipe");
+    exit(EX_OSERR);
+  }
+  /* the read end stays with us; the write end is dup'ed onto the child's
+   * stdout or stderr, so neither copy should leak into the command */
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+}
+
+/* Copy what the child wrote to our own stdout or stderr.  Returns 1 if
+ * there was any, and closes the pipe on end of file.
+ */
+static int relay_output(struct pollfd* pfd, int out_fd) {
+  char buf[BUFSIZ];
+  ssize_t n, written;
+  char* p;
+  int relayed = 0;
+
+  if (pfd->fd < 0 || !(pfd->revents & (POLLIN | POLLHUP))) return 0;
+  while ((n = read(pfd->fd, buf, sizeof(buf))) > 0) {
+    relayed = 1;
+    for (p = buf; n > 0; p += written, n -= written) {
+      if ((written = write(out_fd, p, n)) < 0) {
+        if (errno == EINTR) {
+          written = 0;
+          continue;
+        }
+        break;
+      }
+    }
+  }
+  if (n == 0) {
+    close(pfd->fd);
+    pfd->fd = -1;
+  }
+  return relayed;
+}
+
+/* Run the command like run_subprocess(), but kill its process group once
+ * it stops making progress.  Returns -1 if the command was killed, either
+ * by the watchdog, which then sets wd->stalled, or by an alarm.
+ */
+int run_watched(char* command, char** args, struct watchdog* wd,
+                void (*pre_wait_function)(void)) {
+  struct supervisor sv;
+  struct subprocess sp;
+  struct subprocess* done;
+  struct pollfd fds[3];
+  struct timespec last_progress, last_check, heartbeat_seen;
+  int out[2], err[2];
+  double cpu_seen = 0, cpu;
+  long wait_ms, idle_ms;
+  int status = -1;
+
+  subprocess_init(&sp);
+  fds[1].fd = fds[2].fd = -1;
+  if (wd->watch_output) {
+    make_pipe(out);
+    make_pipe(err);
+    sp.stdout_fd = out[1];
+    sp.stderr_fd = err[1];
+    fds[1].fd = out[0];
+    fds[2].fd = err[0];
+  }
+  memset(&heartbeat_seen, 0, sizeof(heartbeat_seen));
+  if (wd->heartbeat != NULL) heartbeat_changed(wd->heartbeat, &heartbeat_seen);
+
+  if (supervisor_init(&sv) < 0) {
+    perror("supervisor_init");
+    exit(EX_OSERR);
+  }
+  if (supervisor_start(&sv, &sp, command, args) < 0) {
+    perror("fork");
+    exit(EX_OSERR);
+  }
+  if (wd->watch_output) {
+    close(out[1]);
+    close(err[1]);
+    /* a closed stdout shouldn't take us down before the child */
+    signal(SIGPIPE, SIG_IGN);
+  }
+  if (pre_wait_function != NULL) {
+    pre_wait_function();
+  }
+
+  fds[0].fd = sv.epfd;
+  fds[0].events = fds[1].events = fds[2].events = POLLIN;
+  clock_gettime(CLOCK_MONOTONIC, &last_progress);
+  last_check = last_progress;
+  for (;;) {
+    if (supervisor_reap(&sv, &done, 1, 0) > 0) {
+      status = sp.status;
+      break;
+    }
+    /* killed by an alarm; don't wait for the child to die */
+    if (sp.killed) break;
+
+    idle_ms = ms_since(&last_progress);
+    if (idle_ms >= wd->stall_timeout * 1000L) {
+      wd->stalled = 1;
+      kill_process_group();
+      break;
+    }
+    wait_ms = wd->stall_timeout * 1000L - idle_ms;
+    if (wait_ms > CHECK_INTERVAL_MS) wait_ms = CHECK_INTERVAL_MS;
+    if (!sv.use_pidfd && wait_ms > 10) wait_ms = 10;
+    if (poll(fds, 3, wait_ms) < 0) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      break;
+    }
+
+    if (relay_output(&fds[1], STDOUT_FILENO) |
+        relay_output(&fds[2], STDERR_FILENO)) {
+      clock_gettime(CLOCK_MONOTONIC, &last_progress);
+    }
+    if (ms_since(&last_check) >= CHECK_INTERVAL_MS) {
+      clock_gettime(CLOCK_MONOTONIC, &last_check);
+      if (wd->heartbeat != NULL &&
+          heartbeat_changed(wd->heartbeat, &heartbeat_seen)) {
+        last_progress = last_check;
+      }
+      if (wd->watch_cpu && (cpu = job_cpu_ticks(sp.pid)) > cpu_seen) {
+        cpu_seen = cpu;
+        last_progress = last_check;
+      }
+    }
+  }
+
+  /* pass on whatever output is left, without waiting for more */
+  fds[1].revents = fds[2].revents = POLLIN;
+  relay_output(&fds[1], STDOUT_FILENO);
+  relay_output(&fds[2], STDERR_FILENO);
+  if (fds[1].fd >= 0) close(fds[1].fd);
+  if (fds[2].fd >= 0) close(fds[2].fd);
+  supervisor_close(&sv);
+  alarm(0);
+  return status;
+}
@@ -0,0 +1,39 @@
+/*
+Copyright 2010 Google, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+     http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef __CRONUTILS_WATCHDOG_H
+#define __CRONUTILS_WATCHDOG_H
+
+/* A job stalls when none of the watched kinds of progress happen for
+ * stall_timeout seconds.
+ */
+struct watchdog {
+  int stall_timeout;
+  /* output on stdout or stderr, relayed through pipes */
+  int watch_output;
+  /* CPU time used by the job's processes */
+  int watch_cpu;
+  /* modification of this file, or NULL */
+  const char* heartbeat;
+
+  /* set if the job was killed for stalling */
+  int stalled;
+};
+
+int run_watched(char* command, char** args, struct watchdog* wd,
+                void (*pre_wait_function)(void));
+
+#endif /* __CRONUTILS_WATCHDOG_H */